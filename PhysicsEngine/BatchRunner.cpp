@@ -0,0 +1,154 @@
+#include "BatchRunner.h"
+
+#include <atomic>
+#include <random>
+#include <thread>
+
+using namespace physx;
+using namespace std;
+
+PhysicsEngineDesc BatchRunner::headlessDesc()
+{
+	PhysicsEngineDesc desc;
+	desc.workerThreads = 0;
+	desc.debrisBudget = 0;
+	return desc;
+}
+
+BatchRunner::BatchRunner(const PhysicsEngineDesc &desc, PxU32 threads):
+	engineDesc(desc),
+	threads(threads),
+	randomSamples(0),
+	randomSeed(1)
+{
+	// Runs are stepped by the runner as fast as they go, never by the wall clock, and nothing draws them
+	engineDesc.startUpdateThread = false;
+	engineDesc.publishSnapshots = false;
+	if (this->threads == 0)
+		this->threads = PxMax(thread::hardware_concurrency(), 1u);
+}
+
+void BatchRunner::addParameter(const string &name, PxReal first, PxReal last, PxU32 count)
+{
+	Parameter parameter;
+	parameter.name = name;
+	parameter.first = first;
+	parameter.last = last;
+	parameter.count = PxMax(count, 1u);
+	parameters.push_back(parameter);
+}
+
+void BatchRunner::setResultNames(const vector<string> &names)
+{
+	resultNames = names;
+}
+
+void BatchRunner::setRandomSamples(PxU32 samples, unsigned int seed)
+{
+	randomSamples = samples;
+	randomSeed = seed;
+}
+
+void BatchRunner::buildRuns()
+{
+	runParameters.clear();
+	if (randomSamples > 0)
+	{
+		mt19937 generator(randomSeed);
+		uniform_real_distribution<PxReal> unit(0.0f, 1.0f);
+		runParameters.resize(randomSamples);
+		for (PxU32 i = 0; i < randomSamples; i++)
+			for (size_t j = 0; j < parameters.size(); j++)
+				runParameters[i].push_back(parameters[j].first + (parameters[j].last - parameters[j].first) * unit(generator));
+		return;
+	}
+
+	// Every combination, with the last parameter changing fastest
+	size_t numRuns = 1;
+	for (size_t j = 0; j < parameters.size(); j++)
+		numRuns *= parameters[j].count;
+	runParameters.resize(numRuns);
+	for (size_t i = 0; i < numRuns; i++)
+	{
+		size_t index = i;
+		runParameters[i].resize(parameters.size());
+		for (size_t j = parameters.size(); j-- > 0;)
+		{
+			const Parameter &parameter = parameters[j];
+			PxU32 step = PxU32(index % parameter.count);
+			index /= parameter.count;
+			PxReal t = (parameter.count > 1) ? PxReal(step) / PxReal(parameter.count - 1) : 0.0f;
+			runParameters[i][j] = parameter.first + (parameter.last - parameter.first) * t;
+		}
+	}
+}
+
+PxU32 BatchRunner::run(Scenario scenario, PxU32 steps, Measure measure, Setup setup)
+{
+	buildRuns();
+	runResults.assign(runParameters.size(), vector<PxReal>());
+
+	// The runner's engine holds a reference to the shared SDK until the batch is done, so it isn't torn down and rebuilt
+	// (taking the assets with it) whenever no run happens to be alive
+	PhysicsEngine host(engineDesc);
+	BatchAssets assets;
+	if (setup)
+		setup(host, assets);
+
+	// Each thread takes the next run that nobody has started, so long and short runs balance out
+	atomic<size_t> nextRun(0);
+	function<void()> worker = [&]()
+	{
+		for (size_t i = nextRun++; i < runParameters.size(); i = nextRun++)
+		{
+			PhysicsEngine engine(engineDesc);
+			if (scenario)
+				scenario(engine, runParameters[i], assets);
+			engine.step(steps);
+			runResults[i].assign(resultNames.size(), 0.0f);
+			if (measure)
+				measure(engine, runParameters[i], runResults[i]);
+		}
+	};
+
+	vector<thread> pool;
+	for (PxU32 i = 1; i < threads; i++)
+		pool.push_back(thread(worker));
+	worker();
+	for (size_t i = 0; i < pool.size(); i++)
+		pool[i].join();
+
+	// Every run's engine is gone, so nothing uses the assets any more
+	for (size_t i = 0; i < assets.convexMeshes.size(); i++)
+		if (assets.convexMeshes[i] != nullptr)
+			assets.convexMeshes[i]->release();
+	for (size_t i = 0; i < assets.triangleMeshes.size(); i++)
+		if (assets.triangleMeshes[i] != nullptr)
+			assets.triangleMeshes[i]->release();
+	for (size_t i = 0; i < assets.heightFields.size(); i++)
+		if (assets.heightFields[i] != nullptr)
+			assets.heightFields[i]->release();
+	return PxU32(runParameters.size());
+}
+
+void BatchRunner::writeResults(FILE *file) const
+{
+	if (file == nullptr)
+		return;
+	fprintf(file, "run");
+	for (size_t j = 0; j < parameters.size(); j++)
+		fprintf(file, ",%s", parameters[j].name.c_str());
+	for (size_t j = 0; j < resultNames.size(); j++)
+		fprintf(file, ",%s", resultNames[j].c_str());
+	fprintf(file, "\n");
+
+	for (size_t i = 0; i < runParameters.size(); i++)
+	{
+		fprintf(file, "%u", PxU32(i));
+		for (size_t j = 0; j < runParameters[i].size(); j++)
+			fprintf(file, ",%g", runParameters[i][j]);
+		for (size_t j = 0; j < runResults[i].size(); j++)
+			fprintf(file, ",%g", runResults[i][j]);
+		fprintf(file, "\n");
+	}
+}
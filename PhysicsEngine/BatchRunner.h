@@ -0,0 +1,76 @@
+#ifndef _BATCH_RUNNER_H_
+#define _BATCH_RUNNER_H_
+
+#include "PhysicsEngine.h"
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// Meshes cooked once by a batch's Setup function and used by every run. The runner releases them when the batch is done
+struct BatchAssets
+{
+	std::vector<physx::PxConvexMesh*> convexMeshes;
+	std::vector<physx::PxTriangleMesh*> triangleMeshes;
+	std::vector<physx::PxHeightField*> heightFields;
+};
+
+// Runs many headless instances of a scenario, each with different parameter values, as fast as the machine allows.
+// Every instance gets its own engine (and scene), but they all share the PhysX SDK and anything cooked with it
+class BatchRunner
+{
+public:
+	// Cooks the assets every run shares, once before the runs start. engine is the runner's own, which keeps the SDK alive
+	// for the whole batch
+	typedef std::function<void(PhysicsEngine &engine, BatchAssets &assets)> Setup;
+
+	// Builds the scene for one run. parameters holds one value for each parameter, in the order they were added
+	typedef std::function<void(PhysicsEngine &engine, const std::vector<physx::PxReal> &parameters, const BatchAssets &assets)> Scenario;
+
+	// Measures a finished run, writing one value for each result name into results
+	typedef std::function<void(PhysicsEngine &engine, const std::vector<physx::PxReal> &parameters, std::vector<physx::PxReal> &results)> Measure;
+
+private:
+	struct Parameter
+	{
+		std::string name;
+		physx::PxReal first;
+		physx::PxReal last;
+		physx::PxU32 count;
+	};
+
+	PhysicsEngineDesc engineDesc;
+	physx::PxU32 threads;
+	std::vector<Parameter> parameters;
+	std::vector<std::string> resultNames;
+	physx::PxU32 randomSamples;				// 0 runs the full grid
+	unsigned int randomSeed;
+	std::vector<std::vector<physx::PxReal>> runParameters;
+	std::vector<std::vector<physx::PxReal>> runResults;
+
+	void buildRuns();
+
+public:
+	// The default engine description for runs: no worker threads (each run simulates on its pool thread) and no debris
+	static PhysicsEngineDesc headlessDesc();
+
+	// Runs use desc (without an update thread or snapshots) spread over the given number of threads (0 uses one per core)
+	BatchRunner(const PhysicsEngineDesc &desc = headlessDesc(), physx::PxU32 threads = 0);
+
+	// Adds a parameter swept over count evenly spaced values from first to last
+	void addParameter(const std::string &name, physx::PxReal first, physx::PxReal last, physx::PxU32 count);
+
+	// Names the values the Measure function writes (they head the result columns)
+	void setResultNames(const std::vector<std::string> &names);
+
+	// Instead of every combination, runs samples random combinations with each parameter drawn uniformly from its range (Monte Carlo)
+	void setRandomSamples(physx::PxU32 samples, unsigned int seed = 1);
+
+	// Calls setup once, then builds and simulates every run for steps steps and measures it. Returns the number of runs
+	physx::PxU32 run(Scenario scenario, physx::PxU32 steps, Measure measure, Setup setup = Setup());
+
+	// Writes the results of the last run as comma separated values: a header line, then one line per run with its parameters and results
+	void writeResults(FILE *file) const;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "CpuDispatcher.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace physx;
+using namespace std;
+
+ThreadSchedule::ThreadSchedule():
+	core(-1),
+	realtime(false),
+	priority(0)
+{
+}
+
+bool ThreadSchedule::apply() const
+{
+	bool applied = true;
+#ifdef _WIN32
+	HANDLE thread = GetCurrentThread();
+	if ((core >= 0) && (SetThreadAffinityMask(thread, DWORD_PTR(1) << core) == 0))
+	{
+		printf("Error: SetThreadAffinityMask Failed (core %d)\n", core);
+		applied = false;
+	}
+	int windowsPriority = THREAD_PRIORITY_NORMAL;
+	if (realtime)
+		windowsPriority = THREAD_PRIORITY_TIME_CRITICAL;
+	else if (priority < 0)
+		windowsPriority = (priority <= -10) ? THREAD_PRIORITY_HIGHEST : THREAD_PRIORITY_ABOVE_NORMAL;
+	else if (priority > 0)
+		windowsPriority = (priority >= 10) ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL;
+	if ((windowsPriority != THREAD_PRIORITY_NORMAL) && !SetThreadPriority(thread, windowsPriority))
+	{
+		printf("Error: SetThreadPriority Failed\n");
+		applied = false;
+	}
+#else
+	if (core >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(core, &cpus);
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (error != 0)
+		{
+			printf("Error: pthread_setaffinity_np Failed (core %d): %s\n", core, strerror(error));
+			applied = false;
+		}
+	}
+	if (realtime)
+	{
+		sched_param param;
+		param.sched_priority = (priority > 0) ? priority : 1;
+		int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (error != 0)
+		{
+			printf("Error: pthread_setschedparam Failed (SCHED_FIFO %d): %s\n", param.sched_priority, strerror(error));
+			applied = false;
+		}
+	}
+	else if (priority != 0)
+	{
+		// On Linux the nice value belongs to the thread, not the process
+		if (setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), priority) != 0)
+		{
+			printf("Error: setpriority Failed (nice %d): %s\n", priority, strerror(errno));
+			applied = false;
+		}
+	}
+#endif
+	return applied;
+}
+
+CpuDispatcher::CpuDispatcher(const vector<ThreadSchedule> &workerSchedules):
+	schedules(workerSchedules),
+	tasks(256),
+	taskHead(0),
+	taskCount(0),
+	quit(false),
+	rangesRemaining(0)
+{
+	for (PxU32 i = 0; i < schedules.size(); i++)
+		workers.push_back(thread(workerLoop, this, i));
+}
+
+void CpuDispatcher::workerLoop(CpuDispatcher *dispatcher, PxU32 index)
+{
+	dispatcher->schedules[index].apply();
+	unique_lock<mutex> lock(dispatcher->queueMutex);
+	while (true)
+	{
+		dispatcher->queueCondition.wait(lock, [dispatcher]() { return dispatcher->quit || (dispatcher->taskCount > 0); });
+		if (dispatcher->taskCount == 0)
+			return;
+		PxBaseTask *task = dispatcher->popTask();
+		lock.unlock();
+		task->run();
+		task->release();
+		lock.lock();
+	}
+}
+
+void CpuDispatcher::submitTask(PxBaseTask &task)
+{
+	if (workers.empty())
+	{
+		task.run();
+		task.release();
+		return;
+	}
+	{
+		unique_lock<mutex> lock(queueMutex);
+		pushTask(&task);
+	}
+	queueCondition.notify_one();
+}
+
+void CpuDispatcher::pushTask(PxBaseTask *task)
+{
+	if (taskCount == tasks.size())
+	{
+		// Unwrap the ring into a buffer twice the size
+		vector<PxBaseTask*> grown(tasks.size() * 2);
+		for (size_t i = 0; i < taskCount; i++)
+			grown[i] = tasks[(taskHead + i) % tasks.size()];
+		tasks.swap(grown);
+		taskHead = 0;
+	}
+	tasks[(taskHead + taskCount) % tasks.size()] = task;
+	taskCount++;
+}
+
+PxBaseTask *CpuDispatcher::popTask()
+{
+	PxBaseTask *task = tasks[taskHead];
+	taskHead = (taskHead + 1) % tasks.size();
+	taskCount--;
+	return task;
+}
+
+PxU32 CpuDispatcher::getWorkerCount() const
+{
+	return PxU32(workers.size());
+}
+
+void CpuDispatcher::RangeTask::run()
+{
+	(*body)(begin, end);
+}
+
+const char *CpuDispatcher::RangeTask::getName() const
+{
+	return "CpuDispatcher.parallelFor";
+}
+
+void CpuDispatcher::RangeTask::addReference()
+{
+}
+
+void CpuDispatcher::RangeTask::removeReference()
+{
+}
+
+PxI32 CpuDispatcher::RangeTask::getReference() const
+{
+	return 1;
+}
+
+void CpuDispatcher::RangeTask::release()
+{
+	unique_lock<mutex> lock(dispatcher->queueMutex);
+	if (--dispatcher->rangesRemaining == 0)
+		dispatcher->rangeCondition.notify_all();
+}
+
+void CpuDispatcher::parallelFor(PxU32 count, PxU32 grainSize, const function<void(PxU32, PxU32)> &body)
+{
+	if (count == 0)
+		return;
+	grainSize = (grainSize > 0) ? grainSize : 1;
+	PxU32 numRanges = (count + grainSize - 1) / grainSize;
+	if ((numRanges == 1) || workers.empty())
+	{
+		body(0, count);
+		return;
+	}
+
+	// The caller runs the first range itself, and the rest are queued. The task list keeps its capacity between calls
+	rangeTasks.resize(numRanges - 1);
+	unique_lock<mutex> lock(queueMutex);
+	rangesRemaining = numRanges - 1;
+	for (PxU32 i = 1; i < numRanges; i++)
+	{
+		RangeTask &task = rangeTasks[i - 1];
+		task.body = &body;
+		task.begin = i * grainSize;
+		task.end = PxMin(count, (i + 1) * grainSize);
+		task.dispatcher = this;
+		pushTask(&task);
+	}
+	lock.unlock();
+	queueCondition.notify_all();
+
+	body(0, grainSize);
+
+	// Help with the remaining ranges rather than waiting idle
+	lock.lock();
+	while (rangesRemaining > 0)
+	{
+		if (taskCount == 0)
+		{
+			rangeCondition.wait(lock);
+			continue;
+		}
+		PxBaseTask *task = popTask();
+		lock.unlock();
+		task->run();
+		task->release();
+		lock.lock();
+	}
+}
+
+double CpuDispatcher::getWorkerCpuTime(PxU32 worker)
+{
+	if (worker >= workers.size())
+		return 0.0;
+	return getCpuTime(workers[worker]);
+}
+
+double CpuDispatcher::getCpuTime(thread &thread)
+{
+	if (!thread.joinable())
+		return 0.0;
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	if (!GetThreadTimes(thread.native_handle(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	// FILETIMEs count 100 ns intervals
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return double(k.QuadPart + u.QuadPart) * 1e-7;
+#else
+	clockid_t clock;
+	timespec time;
+	if ((pthread_getcpuclockid(thread.native_handle(), &clock) != 0) || (clock_gettime(clock, &time) != 0))
+		return 0.0;
+	return double(time.tv_sec) + double(time.tv_nsec) * 1e-9;
+#endif
+}
+
+CpuDispatcher::~CpuDispatcher()
+{
+	{
+		unique_lock<mutex> lock(queueMutex);
+		quit = true;
+	}
+	queueCondition.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
@@ -0,0 +1,81 @@
+#ifndef _CPU_DISPATCHER_H_
+#define _CPU_DISPATCHER_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <PxPhysicsAPI.h>
+
+// How the operating system should schedule one of the engine's threads
+struct ThreadSchedule
+{
+	int core;				// DEFAULT: -1 (any core). The core the thread is pinned to
+	bool realtime;			// DEFAULT: false. Linux: SCHED_FIFO (needs CAP_SYS_NICE). Windows: time critical priority
+	int priority;			// DEFAULT: 0. The SCHED_FIFO priority (1 to 99) if realtime, otherwise the nice value (-20 to 19)
+
+	ThreadSchedule();
+
+	// Applies the schedule to the calling thread. Returns false (and prints the error) if any part of it was refused
+	bool apply() const;
+};
+
+// Runs PhysX tasks on a fixed set of worker threads, each with its own schedule
+class CpuDispatcher : public physx::PxCpuDispatcher
+{
+private:
+	std::vector<std::thread> workers;
+	std::vector<ThreadSchedule> schedules;
+	std::vector<physx::PxBaseTask*> tasks;		// A ring that only grows, so queueing doesn't allocate once it is big enough
+	size_t taskHead;
+	size_t taskCount;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool quit;
+
+	static void workerLoop(CpuDispatcher *dispatcher, physx::PxU32 index);
+
+	// Queue operations, called with queueMutex held
+	void pushTask(physx::PxBaseTask *task);
+	physx::PxBaseTask *popTask();
+
+	// A range of a parallelFor, run on a worker like any PhysX task
+	struct RangeTask : public physx::PxBaseTask
+	{
+		const std::function<void(physx::PxU32, physx::PxU32)> *body;
+		physx::PxU32 begin, end;
+		CpuDispatcher *dispatcher;
+		virtual void run();
+		virtual const char *getName() const;
+		virtual void addReference();
+		virtual void removeReference();
+		virtual physx::PxI32 getReference() const;
+		virtual void release();
+	};
+	std::vector<RangeTask> rangeTasks;
+	physx::PxU32 rangesRemaining;
+	std::condition_variable rangeCondition;
+
+public:
+	// Starts one worker for each schedule. With none, tasks run on the thread that submits them
+	CpuDispatcher(const std::vector<ThreadSchedule> &workerSchedules);
+
+	virtual void submitTask(physx::PxBaseTask &task);
+	virtual physx::PxU32 getWorkerCount() const;
+
+	// Calls body(begin, end) over ranges of at most grainSize items covering 0 to count, spread across the workers and the
+	// calling thread, and returns when every range is done. Must not be called while the workers are running a PhysX step
+	void parallelFor(physx::PxU32 count, physx::PxU32 grainSize, const std::function<void(physx::PxU32, physx::PxU32)> &body);
+
+	// Returns the CPU time (in seconds) used so far by a worker
+	double getWorkerCpuTime(physx::PxU32 worker);
+
+	// Returns the CPU time (in seconds) used so far by a thread
+	static double getCpuTime(std::thread &thread);
+
+	// Stops the workers once the queued tasks have run
+	virtual ~CpuDispatcher();
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include "MeshImporter.h"
+
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace physx;
+using namespace std;
+
+// OBJ files smaller than this are parsed on the calling thread alone
+#define OBJ_PARALLEL_THRESHOLD (1 << 20)
+
+#pragma region Imported Mesh
+ImportedMesh::ImportedMesh():
+	mapping(nullptr),
+	mappingSize(0),
+#ifdef _WIN32
+	fileHandle(INVALID_HANDLE_VALUE),
+	mappingHandle(nullptr),
+#else
+	fileDescriptor(-1),
+#endif
+	vertices(nullptr),
+	numVertices(0),
+	indices(nullptr),
+	numIndices(0),
+	indices16Bit(false)
+{
+}
+
+bool ImportedMesh::map(const char *path)
+{
+#ifdef _WIN32
+	fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(fileHandle, &size) || (size.QuadPart == 0))
+		return false;
+	mappingSize = size_t(size.QuadPart);
+	mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle == nullptr)
+		return false;
+	mapping = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	return mapping != nullptr;
+#else
+	fileDescriptor = open(path, O_RDONLY);
+	if (fileDescriptor < 0)
+		return false;
+	struct stat info;
+	if ((fstat(fileDescriptor, &info) != 0) || (info.st_size == 0))
+		return false;
+	mappingSize = size_t(info.st_size);
+	void *address = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+	if (address == MAP_FAILED)
+		return false;
+	// The whole file is read front to back (or cooked straight from the mapping), so ask for it up front
+	madvise(address, mappingSize, MADV_WILLNEED);
+	mapping = (const char*)address;
+	return true;
+#endif
+}
+
+void ImportedMesh::unmap()
+{
+#ifdef _WIN32
+	if (mapping != nullptr)
+		UnmapViewOfFile(mapping);
+	if (mappingHandle != nullptr)
+		CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (mapping != nullptr)
+		munmap((void*)mapping, mappingSize);
+	if (fileDescriptor >= 0)
+		close(fileDescriptor);
+	fileDescriptor = -1;
+#endif
+	mapping = nullptr;
+	mappingSize = 0;
+}
+
+const PxVec3 *ImportedMesh::getVertices() const
+{
+	return vertices;
+}
+
+PxU32 ImportedMesh::getNumVertices() const
+{
+	return numVertices;
+}
+
+const void *ImportedMesh::getIndices() const
+{
+	return indices;
+}
+
+PxU32 ImportedMesh::getNumIndices() const
+{
+	return numIndices;
+}
+
+bool ImportedMesh::hasIndices16Bit() const
+{
+	return indices16Bit;
+}
+
+ImportedMesh::~ImportedMesh()
+{
+	unmap();
+}
+#pragma endregion
+
+ImportedMesh *MeshImporter::load(const char *path, PxU32 threads)
+{
+	ImportedMesh *mesh = new ImportedMesh();
+	if ((path == nullptr) || !mesh->map(path))
+	{
+		printf("Error: MeshImporter could not map %s\n", (path != nullptr) ? path : "(null)");
+		delete mesh;
+		return nullptr;
+	}
+
+	bool loaded;
+	if ((mesh->mappingSize >= sizeof(MeshFileHeader)) && (memcmp(mesh->mapping, "PXMB", 4) == 0))
+		loaded = loadBinary(*mesh);
+	else
+	{
+		loaded = loadObj(*mesh, (threads > 0) ? threads : PxMax(thread::hardware_concurrency(), 1u));
+		// Parsed meshes don't refer to the file, so it can be let go now
+		mesh->unmap();
+	}
+	if (!loaded)
+	{
+		printf("Error: MeshImporter could not read %s\n", path);
+		delete mesh;
+		return nullptr;
+	}
+	return mesh;
+}
+
+bool MeshImporter::loadBinary(ImportedMesh &mesh)
+{
+	MeshFileHeader header;
+	memcpy(&header, mesh.mapping, sizeof(header));
+	if ((header.version != 1) || ((header.indexSize != 2) && (header.indexSize != 4)))
+		return false;
+	size_t vertexBytes = size_t(header.numVertices) * sizeof(PxVec3);
+	size_t indexBytes = size_t(header.numIndices) * header.indexSize;
+	if (sizeof(header) + vertexBytes + indexBytes > mesh.mappingSize)
+		return false;
+
+	// The file is laid out the way cooking reads it, so the mesh points straight into the mapping
+	mesh.vertices = (const PxVec3*)(mesh.mapping + sizeof(header));
+	mesh.numVertices = header.numVertices;
+	mesh.indices = mesh.mapping + sizeof(header) + vertexBytes;
+	mesh.numIndices = header.numIndices;
+	mesh.indices16Bit = (header.indexSize == 2);
+	return true;
+}
+
+bool MeshImporter::loadObj(ImportedMesh &mesh, PxU32 threads)
+{
+	const char *begin = mesh.mapping;
+	const char *end = mesh.mapping + mesh.mappingSize;
+	if (mesh.mappingSize < OBJ_PARALLEL_THRESHOLD)
+		threads = 1;
+
+	// Split the file into one chunk per thread, each ending at a line break
+	vector<ObjChunk> chunks(threads);
+	const char *chunkBegin = begin;
+	for (PxU32 i = 0; i < threads; i++)
+	{
+		const char *chunkEnd = (i + 1 == threads) ? end : begin + (mesh.mappingSize / threads) * (i + 1);
+		chunkEnd = PxMax(chunkEnd, chunkBegin);
+		while ((chunkEnd < end) && (*chunkEnd != '\n'))
+			chunkEnd++;
+		if (chunkEnd < end)
+			chunkEnd++;
+		chunks[i].begin = chunkBegin;
+		chunks[i].end = chunkEnd;
+		chunkBegin = chunkEnd;
+	}
+
+	// The first pass counts what each chunk holds, so the second can write straight into its own part of the output
+	vector<thread> pool;
+	for (PxU32 i = 1; i < threads; i++)
+		pool.push_back(thread(countObjChunk, ref(chunks[i])));
+	countObjChunk(chunks[0]);
+	for (size_t i = 0; i < pool.size(); i++)
+		pool[i].join();
+	pool.clear();
+
+	PxU32 totalVertices = 0, totalTriangles = 0;
+	for (PxU32 i = 0; i < threads; i++)
+	{
+		chunks[i].firstVertex = totalVertices;
+		chunks[i].firstTriangle = totalTriangles;
+		totalVertices += chunks[i].numVertices;
+		totalTriangles += chunks[i].numTriangles;
+	}
+	if ((totalVertices == 0) || (totalTriangles == 0))
+		return false;
+
+	// The index width is known before any index is parsed
+	mesh.parsedVertices.resize(totalVertices);
+	mesh.indices16Bit = (totalVertices <= 0xffff);
+	if (mesh.indices16Bit)
+		mesh.parsedIndices16.resize(size_t(totalTriangles) * 3);
+	else
+		mesh.parsedIndices32.resize(size_t(totalTriangles) * 3);
+
+	for (PxU32 i = 1; i < threads; i++)
+		pool.push_back(thread(parseObjChunk, ref(chunks[i]), ref(mesh)));
+	parseObjChunk(chunks[0], mesh);
+	for (size_t i = 0; i < pool.size(); i++)
+		pool[i].join();
+
+	// Faces naming vertices that don't exist (or that aren't numbers) fail the whole file, rather than the cooking later on
+	PxU32 badCorners = 0;
+	for (PxU32 i = 0; i < threads; i++)
+		badCorners += chunks[i].badCorners;
+	if (badCorners > 0)
+	{
+		printf("Error: MeshImporter found %u face corners that don't name one of the %u vertices\n", badCorners, totalVertices);
+		return false;
+	}
+
+	mesh.vertices = &mesh.parsedVertices[0];
+	mesh.numVertices = totalVertices;
+	mesh.numIndices = totalTriangles * 3;
+	if (mesh.indices16Bit)
+		mesh.indices = &mesh.parsedIndices16[0];
+	else
+		mesh.indices = &mesh.parsedIndices32[0];
+	return true;
+}
+
+// Returns a pointer to the start of the next line
+static const char *nextLine(const char *p, const char *end)
+{
+	while ((p < end) && (*p != '\n'))
+		p++;
+	return (p < end) ? p + 1 : end;
+}
+
+static const char *skipSpaces(const char *p, const char *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t')))
+		p++;
+	return p;
+}
+
+// Parses a number without reading past end (the mapping isn't null terminated)
+static const char *parseFloat(const char *p, const char *end, PxReal &value)
+{
+	p = skipSpaces(p, end);
+	bool negative = false;
+	if ((p < end) && ((*p == '-') || (*p == '+')))
+		negative = (*p++ == '-');
+	double result = 0.0;
+	while ((p < end) && (*p >= '0') && (*p <= '9'))
+		result = result * 10.0 + double(*p++ - '0');
+	if ((p < end) && (*p == '.'))
+	{
+		p++;
+		double scale = 0.1;
+		while ((p < end) && (*p >= '0') && (*p <= '9'))
+		{
+			result += double(*p++ - '0') * scale;
+			scale *= 0.1;
+		}
+	}
+	if ((p < end) && ((*p == 'e') || (*p == 'E')))
+	{
+		p++;
+		bool negativeExponent = false;
+		if ((p < end) && ((*p == '-') || (*p == '+')))
+			negativeExponent = (*p++ == '-');
+		int exponent = 0;
+		while ((p < end) && (*p >= '0') && (*p <= '9'))
+			exponent = exponent * 10 + (*p++ - '0');
+		result *= pow(10.0, negativeExponent ? -exponent : exponent);
+	}
+	value = PxReal(negative ? -result : result);
+	return p;
+}
+
+// Parses the vertex index of one face corner ("v", "v/vt", "v//vn" or "v/vt/vn"), and returns false at the end of the line
+static bool parseCorner(const char *&p, const char *end, long &index)
+{
+	p = skipSpaces(p, end);
+	if ((p >= end) || (*p == '\n') || (*p == '\r') || (*p == '#'))
+		return false;
+	bool negative = false;
+	if (*p == '-')
+	{
+		negative = true;
+		p++;
+	}
+	index = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9'))
+		index = index * 10 + (*p++ - '0');
+	if (negative)
+		index = -index;
+	while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r'))
+		p++;
+	return true;
+}
+
+void MeshImporter::countObjChunk(ObjChunk &chunk)
+{
+	chunk.numVertices = 0;
+	chunk.numTriangles = 0;
+	for (const char *p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end))
+	{
+		p = skipSpaces(p, chunk.end);
+		if (chunk.end - p < 2)
+			continue;
+		if ((p[0] == 'v') && ((p[1] == ' ') || (p[1] == '\t')))
+			chunk.numVertices++;
+		else if ((p[0] == 'f') && ((p[1] == ' ') || (p[1] == '\t')))
+		{
+			// A polygon of n corners is split into a fan of n - 2 triangles
+			const char *q = p + 1;
+			long index;
+			PxU32 corners = 0;
+			while (parseCorner(q, chunk.end, index))
+				corners++;
+			if (corners >= 3)
+				chunk.numTriangles += corners - 2;
+		}
+	}
+}
+
+void MeshImporter::parseObjChunk(ObjChunk &chunk, ImportedMesh &mesh)
+{
+	PxU32 vertex = chunk.firstVertex;
+	size_t index = size_t(chunk.firstTriangle) * 3;
+	chunk.badCorners = 0;
+	PxU32 numVertices = PxU32(mesh.parsedVertices.size());
+	for (const char *p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end))
+	{
+		p = skipSpaces(p, chunk.end);
+		if (chunk.end - p < 2)
+			continue;
+		if ((p[0] == 'v') && ((p[1] == ' ') || (p[1] == '\t')))
+		{
+			PxVec3 &v = mesh.parsedVertices[vertex++];
+			const char *q = parseFloat(p + 1, chunk.end, v.x);
+			q = parseFloat(q, chunk.end, v.y);
+			parseFloat(q, chunk.end, v.z);
+		}
+		else if ((p[0] == 'f') && ((p[1] == ' ') || (p[1] == '\t')))
+		{
+			const char *q = p + 1;
+			long corner;
+			PxU32 corners = 0, first = 0, previous = 0;
+			while (parseCorner(q, chunk.end, corner))
+			{
+				// OBJ indices count from 1, and negative ones count back from the last vertex read so far
+				long resolved = (corner < 0) ? long(vertex) + corner : corner - 1;
+				PxU32 current = 0;
+				if ((resolved >= 0) && (resolved < long(numVertices)))
+					current = PxU32(resolved);
+				else
+					chunk.badCorners++;
+				if (corners == 0)
+					first = current;
+				else if (corners >= 2)
+				{
+					if (mesh.indices16Bit)
+					{
+						mesh.parsedIndices16[index++] = PxU16(first);
+						mesh.parsedIndices16[index++] = PxU16(previous);
+						mesh.parsedIndices16[index++] = PxU16(current);
+					}
+					else
+					{
+						mesh.parsedIndices32[index++] = first;
+						mesh.parsedIndices32[index++] = previous;
+						mesh.parsedIndices32[index++] = current;
+					}
+				}
+				previous = current;
+				corners++;
+			}
+		}
+	}
+}
+
+bool MeshImporter::writeBinary(const char *path, const PxVec3 *vertices, PxU32 numVertices, const PxU32 *indices, PxU32 numIndices)
+{
+	if ((path == nullptr) || (vertices == nullptr) || (indices == nullptr))
+		return false;
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		printf("Error: MeshImporter could not open %s\n", path);
+		return false;
+	}
+
+	MeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PXMB", 4);
+	header.version = 1;
+	header.numVertices = numVertices;
+	header.numIndices = numIndices;
+	header.indexSize = (numVertices <= 0xffff) ? 2 : 4;
+	bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+	written = written && (fwrite(vertices, sizeof(PxVec3), numVertices, file) == numVertices);
+	if (header.indexSize == 2)
+	{
+		vector<PxU16> narrow(indices, indices + numIndices);
+		written = written && (numIndices == 0 || fwrite(&narrow[0], sizeof(PxU16), numIndices, file) == numIndices);
+	}
+	else
+		written = written && (fwrite(indices, sizeof(PxU32), numIndices, file) == numIndices);
+	fclose(file);
+	return written;
+}
@@ -0,0 +1,95 @@
+#ifndef _MESH_IMPORTER_H_
+#define _MESH_IMPORTER_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <PxPhysicsAPI.h>
+
+// The header of a binary mesh file. It is followed by numVertices vertices (three floats each), then numIndices indices
+// of indexSize bytes each. Every value is little-endian
+struct MeshFileHeader
+{
+	char magic[4];				// "PXMB"
+	uint32_t version;			// 1
+	uint32_t numVertices;
+	uint32_t numIndices;		// Three per triangle
+	uint32_t indexSize;			// 2 or 4
+	uint32_t reserved[3];
+};
+
+// Triangle mesh data loaded from a file. Binary meshes are used straight from the memory-mapped file, without copying
+class ImportedMesh
+{
+	friend class MeshImporter;
+
+private:
+	// The mapped file
+	const char *mapping;
+	size_t mappingSize;
+#ifdef _WIN32
+	void *fileHandle;
+	void *mappingHandle;
+#else
+	int fileDescriptor;
+#endif
+
+	// Storage for meshes parsed from text (binary meshes point into the mapping instead)
+	std::vector<physx::PxVec3> parsedVertices;
+	std::vector<physx::PxU32> parsedIndices32;
+	std::vector<physx::PxU16> parsedIndices16;
+
+	const physx::PxVec3 *vertices;
+	physx::PxU32 numVertices;
+	const void *indices;
+	physx::PxU32 numIndices;
+	bool indices16Bit;
+
+	ImportedMesh();
+	ImportedMesh(const ImportedMesh&);
+	ImportedMesh &operator=(const ImportedMesh&);
+	bool map(const char *path);
+	void unmap();
+
+public:
+	const physx::PxVec3 *getVertices() const;
+	physx::PxU32 getNumVertices() const;
+
+	// Returns the indices, three per triangle. They are PxU16 if hasIndices16Bit, otherwise PxU32
+	const void *getIndices() const;
+	physx::PxU32 getNumIndices() const;
+	bool hasIndices16Bit() const;
+
+	~ImportedMesh();
+};
+
+// Loads triangle meshes from Wavefront OBJ files and from binary mesh files
+class MeshImporter
+{
+private:
+	struct ObjChunk
+	{
+		const char *begin;
+		const char *end;
+		physx::PxU32 numVertices;		// Counted in the first pass
+		physx::PxU32 numTriangles;
+		physx::PxU32 firstVertex;		// Where the chunk's output starts, from the counts of the chunks before it
+		physx::PxU32 firstTriangle;
+		physx::PxU32 badCorners;		// Face corners found in the second pass that don't name a vertex
+	};
+
+	static bool loadBinary(ImportedMesh &mesh);
+	static bool loadObj(ImportedMesh &mesh, physx::PxU32 threads);
+	static void countObjChunk(ObjChunk &chunk);
+	static void parseObjChunk(ObjChunk &chunk, ImportedMesh &mesh);
+
+public:
+	// Loads a mesh, telling the formats apart by the binary header. Large OBJ files are parsed on the given number of threads
+	// (0 uses one per core). Indices are stored as 16 bit when there are few enough vertices. Returns nullptr on failure
+	static ImportedMesh *load(const char *path, physx::PxU32 threads = 0);
+
+	// Writes a binary mesh file, using 16 bit indices when there are few enough vertices. Returns false on failure
+	static bool writeBinary(const char *path, const physx::PxVec3 *vertices, physx::PxU32 numVertices, const physx::PxU32 *indices, physx::PxU32 numIndices);
+};
+
+#endif
@@ -1,54 +1,173 @@
 #include "PhysicsEngine.h"
 #include "MaterialProperties.h"
 
+#include <algorithm>
+#include <cstring>
+
 using namespace physx;
 using namespace std;
 
-PhysicsEngine::PhysicsEngine():
+// Set in PhysicsEngine::snapshotState when the published snapshot has not been acquired by the consumer yet
+#define SNAPSHOT_FRESH 4
+
+mutex PhysicsEngine::sdkMutex;
+PxFoundation *PhysicsEngine::sharedFoundation = nullptr;
+PxPhysics *PhysicsEngine::sharedPhysics = nullptr;
+PxCooking *PhysicsEngine::sharedCooking = nullptr;
+uint32_t PhysicsEngine::sdkReferences = 0;
+PhysicsEngine::CountingAllocator PhysicsEngine::sdkAllocator;
+
+// The wrapped filter shader leads the CCD shader's constant block, padded so the user's block after it stays 16 byte aligned
+#define CCD_SHADER_BLOCK_HEADER 16
+
+// PhysX needs scratch blocks in multiples of this
+#define SCRATCH_BLOCK_GRANULARITY (16 * 1024)
+
+PhysicsEngineDesc::PhysicsEngineDesc():
+	frequency(360),
+	enableCCD(false),
+	ccdMaxPasses(1),
+	ccdVelocityThreshold(0.0f),
+	enableGovernor(false),
+	governorMinFrequency(60),
+	governorMaxFrequency(360),
+	governorMaxTravel(0.25f),
+	governorContactSpike(2.0f),
+	governorBudget(0.5f),
+	broadPhaseType(PxBroadPhaseType::eSAP),
+	broadPhaseSubdivisions(4),
+	broadPhaseMargin(10.0f),
+	airDensity(1.225f),
+	forceFieldCellSize(10.0f),
+	debrisBudget(16384),
+	debrisLifetime(10.0f),
+	debrisRestitution(0.3f),
+	debrisFriction(0.4f),
+	staticStructure(PxPruningStructure::eDYNAMIC_AABB_TREE),
+	dynamicTreeRebuildRateHint(100),
+	checkpointHistory(8),
+	startUpdateThread(true),
+	workerThreads(1),
+	scratchBlockSize(64 * 1024),
+	statisticsHistory(600),
+	publishSnapshots(true),
+	filterShader(PxDefaultSimulationFilterShader),
+	filterShaderData(nullptr),
+	filterShaderDataSize(0)
+{
+}
+
+PhysicsEngine::PhysicsEngine(const PhysicsEngineDesc &desc):
 	updateThread(nullptr),
+	updateThreadSchedule(desc.updateThreadSchedule),
+	dispatcher(nullptr),
 	physics(nullptr),
+	cooking(nullptr),
 	foundation(nullptr),
 	scene(nullptr),
-	engineFrequency(360)
+	engineFrequency((desc.frequency > 0) ? desc.frequency : 360),
+	ccdVelocityThreshold(desc.enableCCD ? desc.ccdVelocityThreshold : 0.0f),
+	governorEnabled(desc.enableGovernor),
+	governorMinFrequency(PxMax(desc.governorMinFrequency, 1u)),
+	governorMaxFrequency(PxMax(desc.governorMaxFrequency, PxMax(desc.governorMinFrequency, 1u))),
+	governorMaxTravel(desc.governorMaxTravel),
+	governorContactSpike(desc.governorContactSpike),
+	governorBudget(desc.governorBudget),
+	governorContactAverage(0.0f),
+	broadPhaseType(desc.broadPhaseType),
+	broadPhaseSubdivisions(desc.broadPhaseSubdivisions),
+	broadPhaseMargin(desc.broadPhaseMargin),
+	broadPhaseLayoutPending(true),
+	statisticsNext(0),
+	statisticsCount(0),
+	scratchBlock(nullptr),
+	scratchBlockSize(0),
+	lodInterval(1),
+	snapshotWriteIndex(0),
+	publishSnapshots(desc.publishSnapshots),
+	snapshotReadIndex(1),
+	stepCount(0),
+	airDensity(desc.airDensity),
+	forceFieldCellSize((desc.forceFieldCellSize > 0.0f) ? desc.forceFieldCellSize : 10.0f),
+	nextForceFieldHandle(1),
+	forceFieldGridDirty(false),
+	debrisBudget(desc.debrisBudget),
+	debrisLifetime(desc.debrisLifetime),
+	debrisRestitution(desc.debrisRestitution),
+	debrisFriction(desc.debrisFriction),
+	debrisTail(0),
+	debrisCount(0),
+	debrisQuery(nullptr),
+	checkpointNext(0),
+	checkpointCount(0),
+	levelLoader(nullptr),
+	levelPending(false),
+	levelActorCount(0),
+	levelBuildTime(0.0f),
+	levelMergeTime(0.0f),
+	controllerManager(nullptr),
+	exportMatrices(nullptr),
+	exportShapeOutput(nullptr)
 {
-	static PxDefaultErrorCallback gDefaultErrorCallback;
-	static PxDefaultAllocator gDefaultAllocatorCallback;
-	
 	quit.store(0, std::memory_order_release);
+	snapshotState.store(2, std::memory_order_release);
+	levelReady.store(0, std::memory_order_release);
 
-	tolScale = PxTolerancesScale();
-	foundation = PxCreateFoundation(PX_PHYSICS_VERSION, gDefaultAllocatorCallback, gDefaultErrorCallback);
-	if (!foundation)
-	{
-		printf("Error: PxCreateFoundation Failed\n");
-		return;
-	}
+	lastDecision.step = 0;
+	lastDecision.previousFrequency = engineFrequency;
+	lastDecision.frequency = engineFrequency;
+	lastDecision.reason = GovernorDecision::Steady;
+	lastDecision.maxSpeedRatio = 0.0f;
+	lastDecision.contactPairs = 0;
+	lastDecision.stepTime = 0.0f;
 
-	cooking = PxCreateCooking(PX_PHYSICS_VERSION, *foundation, PxCookingParams(tolScale));
-	if (!cooking)
-	{
-		printf("Error: PxCreateCooking Failed\n");
-		return;
-	}
+	statistics.resize(desc.statisticsHistory);
+	checkpoints.resize(PxMax(desc.checkpointHistory, 1u));
 
-	physics = PxCreatePhysics(PX_PHYSICS_VERSION, *foundation, tolScale);
-	if (!physics)
-	{
-		printf("Error: PxCreatePhysics Failed\n");
+	tolScale = PxTolerancesScale();
+	if (!acquireSDK(tolScale))
 		return;
-	}
+	foundation = sharedFoundation;
+	cooking = sharedCooking;
+	physics = sharedPhysics;
 
 	PxSceneDesc sceneDesc = PxSceneDesc(tolScale);
 
 	if (!sceneDesc.cpuDispatcher)
 	{
-		PxDefaultCpuDispatcher* mCpuDispatcher = PxDefaultCpuDispatcherCreate(1);
-		sceneDesc.cpuDispatcher = mCpuDispatcher;
+		vector<ThreadSchedule> schedules(desc.workerThreads);
+		for (size_t i = 0; i < schedules.size() && i < desc.workerSchedules.size(); i++)
+			schedules[i] = desc.workerSchedules[i];
+		dispatcher = new CpuDispatcher(schedules);
+		sceneDesc.cpuDispatcher = dispatcher;
 	}
 
 	if (!sceneDesc.filterShader)
 	{
-		sceneDesc.filterShader = PxDefaultSimulationFilterShader;  //Collision filter mechanism, strange name for it, very misleading
+		sceneDesc.filterShader = (desc.filterShader != nullptr) ? desc.filterShader : PxDefaultSimulationFilterShader;  //Collision filter mechanism, strange name for it, very misleading
+	}
+
+	sceneDesc.broadPhaseType = broadPhaseType;
+	sceneDesc.broadPhaseCallback = &broadPhaseCallback;
+	sceneDesc.staticStructure = desc.staticStructure;
+	sceneDesc.dynamicTreeRebuildRateHint = PxMax(desc.dynamicTreeRebuildRateHint, 4u);
+
+	sceneDesc.filterShaderData = (desc.filterShaderDataSize > 0) ? desc.filterShaderData : nullptr;
+	sceneDesc.filterShaderDataSize = (desc.filterShaderData != nullptr) ? desc.filterShaderDataSize : 0;
+	vector<uint8_t> ccdShaderBlock;
+	if (desc.enableCCD)
+	{
+		// The wrapped shader is passed to ccdFilterShader at the start of the shader's constant block, followed by the user's
+		// own block (PhysX copies it)
+		ccdShaderBlock.resize(CCD_SHADER_BLOCK_HEADER + sceneDesc.filterShaderDataSize);
+		memcpy(&ccdShaderBlock[0], &sceneDesc.filterShader, sizeof(PxSimulationFilterShader));
+		if (sceneDesc.filterShaderDataSize > 0)
+			memcpy(&ccdShaderBlock[CCD_SHADER_BLOCK_HEADER], sceneDesc.filterShaderData, sceneDesc.filterShaderDataSize);
+		sceneDesc.flags |= PxSceneFlag::eENABLE_CCD;
+		sceneDesc.ccdMaxPasses = desc.ccdMaxPasses;
+		sceneDesc.filterShaderData = &ccdShaderBlock[0];
+		sceneDesc.filterShaderDataSize = PxU32(ccdShaderBlock.size());
+		sceneDesc.filterShader = ccdFilterShader;
 	}
 
 	scene = physics->createScene(sceneDesc);
@@ -65,63 +184,394 @@ PhysicsEngine::PhysicsEngine():
 	mtls[SolidSteel] = physics->createMaterial(SOLIDSTEEL_STATIC_FRICTION, SOLIDSTEEL_DYNAMIC_FRICTION, SOLIDSTEEL_RESTITUTION);
 	mtls[Concrete] = physics->createMaterial(CONCRETE_STATIC_FRICTION, CONCRETE_DYNAMIC_FRICTION, CONCRETE_RESTITUTION);
 
-	simulationPeriod = 6.0f / float(engineFrequency);
+	simulationPeriod = 1.0f / float(engineFrequency);
+
+	if (desc.scratchBlockSize > 0)
+	{
+		// PxDefaultAllocator returns 16 byte aligned memory, as simulate needs
+		scratchBlockSize = (desc.scratchBlockSize + SCRATCH_BLOCK_GRANULARITY - 1) / SCRATCH_BLOCK_GRANULARITY * SCRATCH_BLOCK_GRANULARITY;
+		scratchBlock = sdkAllocator.allocate(scratchBlockSize, "ScratchBlock", __FILE__, __LINE__);
+	}
+
+	if (debrisBudget > 0)
+	{
+		// Debris is stored in fixed arrays, so spawning never allocates
+		debrisPositions.resize(debrisBudget);
+		debrisPreviousPositions.resize(debrisBudget);
+		debrisVelocities.resize(debrisBudget);
+		debrisRadii.resize(debrisBudget);
+		debrisAges.resize(debrisBudget);
+		debrisResting.resize(debrisBudget);
+		debrisResults.resize(debrisBudget);
+		debrisQueried.resize(debrisBudget);
+		PxBatchQueryDesc queryDesc(debrisBudget, 0, 0);
+		queryDesc.queryMemory.userRaycastResultBuffer = &debrisResults[0];
+		debrisQuery = scene->createBatchQuery(queryDesc);
+	}
+
+	if (desc.startUpdateThread)
+		updateThread = new thread(updateLoop, this);
+}
+
+bool PhysicsEngine::acquireSDK(const PxTolerancesScale &scale)
+{
+	static PxDefaultErrorCallback gDefaultErrorCallback;
+
+	unique_lock<mutex> lock(sdkMutex);
+	if (sdkReferences == 0)
+	{
+		// PhysX allows a single foundation per process, so every engine shares it, and the physics and cooking built on it
+		sharedFoundation = PxCreateFoundation(PX_PHYSICS_VERSION, sdkAllocator, gDefaultErrorCallback);
+		if (!sharedFoundation)
+		{
+			printf("Error: PxCreateFoundation Failed\n");
+			return false;
+		}
+
+		sharedCooking = PxCreateCooking(PX_PHYSICS_VERSION, *sharedFoundation, PxCookingParams(scale));
+		if (!sharedCooking)
+		{
+			printf("Error: PxCreateCooking Failed\n");
+			sharedFoundation->release();
+			sharedFoundation = nullptr;
+			return false;
+		}
+
+		sharedPhysics = PxCreatePhysics(PX_PHYSICS_VERSION, *sharedFoundation, scale);
+		if (!sharedPhysics || !PxInitExtensions(*sharedPhysics))
+		{
+			printf("Error: PxCreatePhysics or PxInitExtensions Failed\n");
+			if (sharedPhysics)
+				sharedPhysics->release();
+			sharedCooking->release();
+			sharedFoundation->release();
+			sharedPhysics = nullptr;
+			sharedCooking = nullptr;
+			sharedFoundation = nullptr;
+			return false;
+		}
+	}
+	sdkReferences++;
+	return true;
+}
+
+void PhysicsEngine::releaseSDK()
+{
+	unique_lock<mutex> lock(sdkMutex);
+	if ((sdkReferences == 0) || (--sdkReferences > 0))
+		return;
+	PxCloseExtensions();
+	sharedPhysics->release();
+	sharedCooking->release();
+	sharedFoundation->release();
+	sharedPhysics = nullptr;
+	sharedCooking = nullptr;
+	sharedFoundation = nullptr;
+}
+
+void *PhysicsEngine::CountingAllocator::allocate(size_t size, const char *typeName, const char *filename, int line)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return allocator.allocate(size, typeName, filename, line);
+}
+
+void PhysicsEngine::CountingAllocator::deallocate(void *ptr)
+{
+	allocator.deallocate(ptr);
+}
 
-	updateThread = new thread(updateLoop, this);
+uint64_t PhysicsEngine::getAllocationCount()
+{
+	return sdkAllocator.allocations.load(std::memory_order_relaxed);
 }
 
 void PhysicsEngine::updateLoop(PhysicsEngine *pe)
 {
 	if (pe == nullptr)
 		return;
+	pe->updateThreadSchedule.apply();
 	while (0 == pe->quit.load(std::memory_order_acquire))
 	{
 		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-		pe->update();
+		PxReal period = pe->update();
 		chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
-		this_thread::sleep_for(chrono::milliseconds(long(1000 * pe->simulationPeriod)) - (end-start));
+		this_thread::sleep_for(chrono::microseconds(long(1000000 * period)) - chrono::duration_cast<chrono::microseconds>(end-start));
 	}
 }
 
-void PhysicsEngine::update()
+PxReal PhysicsEngine::update()
 {
 	unique_lock<mutex> lock(engineMutex);
 	if (scene != nullptr)
 	{
+		if (levelReady.load(std::memory_order_acquire))
+			mergeStaticLevel();
+		// Gathered before anything is applied, so bodies added since the last step are included and released ones aren't touched.
+		// Nothing can add or release actors while the engine is locked, so the list holds for the rest of the step
+		PxU32 numDynamic = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC);
+		dynamicActors.resize(numDynamic);
+		if (numDynamic > 0)
+			scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC, &dynamicActors[0], numDynamic);
+		if (!forceFields.empty())
+			applyForceFields();
 		for (uint32_t i = 0; i < aeroActors.size(); i++)
-			aeroActors[i].ApplyLiftAndDrag();
-		scene->simulate(simulationPeriod);
+		{
+			PxVec3 airVelocity = forceFields.empty() ? PxVec3(0.0f) : sampleAirVelocity(aeroActors[i].actor->getGlobalPose().p);
+			aeroActors[i].ApplyLiftAndDrag(airVelocity, airDensity);
+		}
+		// Objects outside every MBP region don't collide, so the grid is laid out as soon as there is a level to cover. It is only
+		// tried again once more statics arrive, rather than every step while there are none
+		if (broadPhaseLayoutPending)
+		{
+			broadPhaseLayoutPending = false;
+			if ((broadPhaseType == PxBroadPhaseType::eMBP) && broadPhaseRegions.empty())
+				layoutBroadPhaseRegions(getStaticBounds(), broadPhaseSubdivisions);
+		}
+		broadPhaseCallback.actors.clear();
+		PxReal period = simulationPeriod;
+		if (!kinematicAnimations.empty())
+			updateKinematics(period);
+		chrono::high_resolution_clock::time_point stepStart = chrono::high_resolution_clock::now();
+		scene->simulate(period, nullptr, scratchBlock, scratchBlockSize);
 		scene->fetchResults(true);
-		//*
-		uint32_t count = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC);
-		PxActor **aa = new PxActor*[count];
-		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC, aa, count);
-		for (uint32_t i = 0; i < count; i++)
+		PxReal stepTime = chrono::duration<PxReal>(chrono::high_resolution_clock::now() - stepStart).count();
+		scene->getSimulationStatistics(simulationStats);
+		if (scratchBlock != nullptr)
+			sizeScratchBlock();
+		for (PxU32 i = 0; i < numDynamic && lodBands.empty(); i++)
 		{
-			((PxRigidDynamic*)aa[i])->wakeUp();
-		}//*/
+			// Kinematic actors (moved by motions or character controllers) can't be woken
+			PxRigidDynamic *actor = (PxRigidDynamic*)dynamicActors[i];
+			if (!(actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC))
+				actor->wakeUp();
+		}
+		if (ccdVelocityThreshold > 0.0f)
+			updateAutomaticCCD();
+		if (debrisCount > 0)
+			updateDebris(period);
+		stepCount++;
+		if (!statistics.empty())
+			recordStatistics(period, stepTime);
+		if (!lodBands.empty() && (stepCount % lodInterval == 0))
+			updateLod();
+		if (governorEnabled)
+			updateGovernor(stepTime);
+		if (publishSnapshots)
+			publishSnapshot();
+		return period;
+	}
+	return simulationPeriod;
+}
+
+void PhysicsEngine::publishSnapshot()
+{
+	PhysicsSnapshot &snapshot = snapshots[snapshotWriteIndex];
+
+	PxU32 count = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC);
+	publishActors.resize(count);
+	if (count > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC, &publishActors[0], count);
+
+	snapshot.actors.clear();
+	snapshot.shapes.clear();
+	for (PxU32 i = 0; i < count; i++)
+		publishActor(snapshot, publishActors[i]->isRigidActor());
+
+	// Articulation links aren't returned by getActors
+	PxU32 numArticulations = scene->getNbArticulations();
+	publishArticulations.resize(numArticulations);
+	if (numArticulations > 0)
+		scene->getArticulations(&publishArticulations[0], numArticulations);
+	for (PxU32 i = 0; i < numArticulations; i++)
+	{
+		PxU32 numLinks = publishArticulations[i]->getNbLinks();
+		publishLinks.resize(numLinks);
+		if (numLinks > 0)
+			publishArticulations[i]->getLinks(&publishLinks[0], numLinks);
+		for (PxU32 j = 0; j < numLinks; j++)
+			publishActor(snapshot, publishLinks[j]);
+	}
+
+	publishedActors.resize(snapshot.shapes.size());
+	publishedPoses.resize(snapshot.shapes.size());
+	for (size_t i = 0; i < snapshot.shapes.size(); i++)
+	{
+		publishedActors[i] = snapshot.shapes[i].actor;
+		publishedPoses[i] = snapshot.shapes[i].pose;
+	}
+	snapshot.debris.resize(debrisCount);
+	for (PxU32 i = 0; i < debrisCount; i++)
+	{
+		PxU32 index = (debrisTail + i) % debrisBudget;
+		snapshot.debris[i].previousPosition = debrisPreviousPositions[index];
+		snapshot.debris[i].position = debrisPositions[index];
+		snapshot.debris[i].radius = debrisRadii[index];
+	}
+
+	snapshot.step = stepCount;
+	snapshot.period = simulationPeriod;
+	snapshot.time = chrono::high_resolution_clock::now();
+
+	// Swap the finished snapshot into the middle slot, and take whatever was there as the next one to write
+	snapshotWriteIndex = snapshotState.exchange(snapshotWriteIndex | SNAPSHOT_FRESH, std::memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+}
+
+void PhysicsEngine::publishActor(PhysicsSnapshot &snapshot, PxRigidActor *actor)
+{
+	PxTransform actorPose = actor->getGlobalPose();
+	PxU32 numShapes = actor->getNbShapes();
+	PhysicsSnapshot::Actor entry;
+	entry.actor = actor;
+	entry.bounds = actor->getWorldBounds();
+	entry.firstShape = uint32_t(snapshot.shapes.size());
+	entry.numShapes = numShapes;
+	snapshot.actors.push_back(entry);
+	publishShapes.resize(numShapes);
+	if (numShapes > 0)
+		actor->getShapes(&publishShapes[0], numShapes, 0);
+	for (PxU32 j = 0; j < numShapes; j++)
+	{
+		PhysicsSnapshot::Shape shape;
+		shape.actor = actor;
+		shape.geometry = publishShapes[j]->getGeometry();
+		shape.pose = actorPose * publishShapes[j]->getLocalPose();
+		// Shapes keep their place in the list between steps unless actors were removed before them. Those that moved fail the match
+		// and aren't interpolated for one frame
+		size_t index = snapshot.shapes.size();
+		if (index < publishedActors.size() && publishedActors[index] == actor)
+			shape.previousPose = publishedPoses[index];
+		else
+			shape.previousPose = shape.pose;
+		snapshot.shapes.push_back(shape);
 	}
 }
 
+const PhysicsSnapshot *PhysicsEngine::acquireSnapshot()
+{
+	if (snapshotState.load(std::memory_order_acquire) & SNAPSHOT_FRESH)
+		snapshotReadIndex = snapshotState.exchange(snapshotReadIndex, std::memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+	if (snapshots[snapshotReadIndex].step == 0)
+		return nullptr;
+	return &snapshots[snapshotReadIndex];
+}
+
 void PhysicsEngine::getActors(vector<PxRigidActor*> &actors)
 {
 	unique_lock<mutex> lock(engineMutex);
 	if (scene != nullptr)
 	{
 		PxU32 count = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC);
-		PxActor **aa = new PxActor*[count];
-		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC, aa, count);
+		queryActors.resize(count);
+		if (count > 0)
+			scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC, &queryActors[0], count);
 		actors.clear();
 		for (PxU32 i = 0; i < count; i++)
 		{
-			actors.push_back(aa[i]->isRigidActor());
+			actors.push_back(queryActors[i]->isRigidActor());
 		}
-		delete[] aa;
 	}
 }
 
+PxU32 PhysicsEngine::exportWorldMatrices(float *matrices, PxU32 capacity, PxShape **shapes)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return 0;
+	if ((matrices == nullptr) || (size_t(matrices) & 15))
+	{
+		printf("Error: exportWorldMatrices needs a 16 byte aligned array\n");
+		return 0;
+	}
+
+	// The scene is read now rather than at the last step, so actors added or released since then are handled
+	PxU32 numDynamic = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC);
+	queryActors.resize(numDynamic);
+	if (numDynamic > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC, &queryActors[0], numDynamic);
+
+	// Counting is cheap and serial; it gives every actor a fixed place in the output so the rest can run in parallel
+	exportActors.clear();
+	exportOffsets.clear();
+	PxU32 total = 0;
+	for (PxU32 i = 0; i < numDynamic; i++)
+	{
+		PxRigidDynamic *actor = (PxRigidDynamic*)queryActors[i];
+		if (actor->isSleeping())
+			continue;
+		exportActors.push_back(actor);
+		exportOffsets.push_back(total);
+		total += actor->getNbShapes();
+	}
+	if (total > capacity)
+		return total;
+
+	if (shapes == nullptr)
+	{
+		exportShapes.resize(total);
+		shapes = (total > 0) ? &exportShapes[0] : nullptr;
+	}
+
+	// Capturing only this keeps the function small enough to be stored without allocating
+	exportMatrices = matrices;
+	exportShapeOutput = shapes;
+	function<void(PxU32, PxU32)> body = [this](PxU32 begin, PxU32 end)
+	{
+		float *matrices = exportMatrices;
+		PxShape **shapes = exportShapeOutput;
+		for (PxU32 i = begin; i < end; i++)
+		{
+			PxRigidDynamic *actor = exportActors[i];
+			PxU32 offset = exportOffsets[i];
+			PxU32 numShapes = actor->getNbShapes();
+			PxTransform actorPose = actor->getGlobalPose();
+			PxMat33 actorRotation(actorPose.q);
+			if (numShapes > 0)
+				actor->getShapes(shapes + offset, numShapes, 0);
+			for (PxU32 j = 0; j < numShapes; j++)
+			{
+				// Composing the rotation matrices avoids a quaternion to matrix conversion per shape for the actor's part
+				PxTransform local = shapes[offset + j]->getLocalPose();
+				PxMat33 rotation = actorRotation * PxMat33(local.q);
+				PxVec3 position = actorPose.transform(local.p);
+				float *m = matrices + 16 * size_t(offset + j);
+				m[0] = rotation.column0.x;	m[1] = rotation.column0.y;	m[2] = rotation.column0.z;	m[3] = 0.0f;
+				m[4] = rotation.column1.x;	m[5] = rotation.column1.y;	m[6] = rotation.column1.z;	m[7] = 0.0f;
+				m[8] = rotation.column2.x;	m[9] = rotation.column2.y;	m[10] = rotation.column2.z;	m[11] = 0.0f;
+				m[12] = position.x;			m[13] = position.y;			m[14] = position.z;			m[15] = 1.0f;
+			}
+		}
+	};
+	// The simulation isn't running while the engine is locked, so the workers are free and PhysX reads are safe from any thread
+	if (dispatcher != nullptr)
+		dispatcher->parallelFor(PxU32(exportActors.size()), 256, body);
+	else
+		body(0, PxU32(exportActors.size()));
+	return total;
+}
+
 #pragma region Add Actors
-PxRigidDynamic* PhysicsEngine::addRigidDynamic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, PxReal Mass, PxVec3 MomentOfInertia, PxVec3 initialLinearVelocity, PxVec3 initialAngularVelocity, Material mat, PxReal linearDamping, PxReal angularDamping)
+PxAggregate *PhysicsEngine::createAggregate(PxU32 maxActors, bool selfCollision)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((physics == nullptr) || (scene == nullptr))
+		return nullptr;
+	PxAggregate *aggregate = physics->createAggregate(maxActors, selfCollision);
+	if (aggregate != nullptr)
+		scene->addAggregate(*aggregate);
+	return aggregate;
+}
+
+void PhysicsEngine::addToScene(PxActor &actor, PxAggregate *aggregate)
+{
+	// Aggregates in a scene add their actors to it. A full aggregate falls back to adding the actor on its own
+	if ((aggregate != nullptr) && aggregate->addActor(actor))
+		return;
+	if (aggregate != nullptr)
+		printf("Warning: aggregate is full (%u actors), adding the actor to the scene on its own\n", aggregate->getMaxNbActors());
+	scene->addActor(actor);
+}
+
+PxRigidDynamic* PhysicsEngine::addRigidDynamic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, PxReal Mass, PxVec3 MomentOfInertia, PxVec3 initialLinearVelocity, PxVec3 initialAngularVelocity, Material mat, PxReal linearDamping, PxReal angularDamping, PxAggregate *aggregate)
 {
 	unique_lock<mutex> lock(engineMutex);
 	if ((physics == nullptr) || (scene == nullptr))
@@ -160,11 +610,11 @@ PxRigidDynamic* PhysicsEngine::addRigidDynamic(PxVec3 position, PxQuat orientati
 		PxShape* shape = newActor->createShape(*components[i], *mtls[mat]);
 		shape->setLocalPose(PxTransform(componentLinearOffsets[i], componentAngularOffsets[i]));
 	}
-	scene->addActor(*newActor);
+	addToScene(*newActor, aggregate);
 	return newActor;
 }
 
-PxRigidStatic* PhysicsEngine::addRigidStatic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, Material mat)
+PxRigidStatic* PhysicsEngine::addRigidStatic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, Material mat, PxAggregate *aggregate)
 {
 	unique_lock<mutex> lock(engineMutex);
 	if ((physics == nullptr) || (scene == nullptr))
@@ -189,11 +639,12 @@ PxRigidStatic* PhysicsEngine::addRigidStatic(PxVec3 position, PxQuat orientation
 		PxShape *shape = newActor->createShape(*components[i], *mtls[mat]);
 		shape->setLocalPose(PxTransform(componentLinearOffsets[i], componentAngularOffsets[i]));
 	}
-	scene->addActor(*newActor);
+	addToScene(*newActor, aggregate);
+	broadPhaseLayoutPending = true;
 	return newActor;
 }
 
-PxRigidDynamic *PhysicsEngine::addRigidAerodynamic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, PxReal Mass, PxVec3 MomentOfInertia, PxVec3 initialLinearVelocity, PxVec3 initialAngularVelocity, Material mat, PxReal linearDamping, PxReal angularDamping, PxReal lift, PxReal drag, PxReal planformArea)
+PxRigidDynamic *PhysicsEngine::addRigidAerodynamic(PxVec3 position, PxQuat orientation, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, PxReal Mass, PxVec3 MomentOfInertia, PxVec3 initialLinearVelocity, PxVec3 initialAngularVelocity, Material mat, PxReal linearDamping, PxReal angularDamping, PxReal lift, PxReal drag, PxReal planformArea, PxAggregate *aggregate)
 {
 	unique_lock<mutex> lock(engineMutex);
 	if ((physics == nullptr) || (scene == nullptr))
@@ -237,12 +688,103 @@ PxRigidDynamic *PhysicsEngine::addRigidAerodynamic(PxVec3 position, PxQuat orien
 	aero.DragCoefficient = drag;
 	aero.LiftCoefficient = lift;
 	aero.SurfaceArea = planformArea;
-	scene->addActor(*newActor);
+	addToScene(*newActor, aggregate);
 	aeroActors.push_back(aero);
+	aeroLookup.insert(newActor);
 	return newActor;
 }
 #pragma endregion
 
+#pragma region Joints
+PxJoint *PhysicsEngine::createJoint(JointType type, PxRigidActor *actor0, const PxTransform &localFrame0, PxRigidActor *actor1, const PxTransform &localFrame1)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (physics == nullptr)
+		return nullptr;
+
+	switch (type)
+	{
+	case FixedJoint:
+		return PxFixedJointCreate(*physics, actor0, localFrame0, actor1, localFrame1);
+	case SphericalJoint:
+		return PxSphericalJointCreate(*physics, actor0, localFrame0, actor1, localFrame1);
+	case RevoluteJoint:
+		return PxRevoluteJointCreate(*physics, actor0, localFrame0, actor1, localFrame1);
+	case D6Joint:
+		return PxD6JointCreate(*physics, actor0, localFrame0, actor1, localFrame1);
+	case DistanceJoint:
+		return PxDistanceJointCreate(*physics, actor0, localFrame0, actor1, localFrame1);
+	default:
+		return nullptr;
+	}
+}
+
+PxArticulation *PhysicsEngine::addArticulatedChain(PxRigidActor *anchor, PxTransform anchorFrame, PxU32 numLinks, PxReal linkSpacing, PxGeometry **components, PxVec3 *componentLinearOffsets, PxQuat *componentAngularOffsets, PxU32 numComponents, PxReal linkMass, PxVec3 MomentOfInertia, Material mat, PxReal swingLimit, bool alternate, PxAggregate *aggregate)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((physics == nullptr) || (scene == nullptr) || (numLinks == 0))
+		return nullptr;
+
+	switch (mat)
+	{
+	case Wood:
+	case HollowPVC:
+	case SolidPVC:
+	case HollowSteel:
+	case SolidSteel:
+	case Concrete:
+		break;
+	default:
+		return nullptr;
+	}
+
+	PxTransform anchorWorld = (anchor != nullptr) ? anchor->getGlobalPose() * anchorFrame : anchorFrame;
+	// Joint frames twist about their x axis, so turn x onto the chain (y)
+	PxQuat jointOrientation = anchorWorld.q * PxQuat(PI / 2.0f, PxVec3(0.0f, 0.0f, 1.0f));
+
+	PxArticulation *articulation = physics->createArticulation();
+	PxArticulationLink *parent = nullptr;
+	PxTransform parentPose;
+	for (PxU32 i = 0; i < numLinks; i++)
+	{
+		PxQuat twist = (alternate && (i % 2 == 0)) ? PxQuat(PI / 2.0f, PxVec3(0.0f, 1.0f, 0.0f)) : PxQuat::createIdentity();
+		PxTransform linkPose = anchorWorld * PxTransform(PxVec3(0.0f, -(PxReal(i) + 0.5f) * linkSpacing, 0.0f), twist);
+		PxTransform jointPose(anchorWorld.transform(PxVec3(0.0f, -PxReal(i) * linkSpacing, 0.0f)), jointOrientation);
+
+		PxArticulationLink *link = articulation->createLink(parent, linkPose);
+		for (PxU32 j = 0; j < numComponents; j++)
+		{
+			PxShape *shape = link->createShape(*components[j], *mtls[mat]);
+			shape->setLocalPose(PxTransform(componentLinearOffsets[j], componentAngularOffsets[j]));
+		}
+		link->setMass(linkMass);
+		link->setMassSpaceInertiaTensor(MomentOfInertia);
+
+		if (parent != nullptr)
+		{
+			PxArticulationJoint *joint = link->getInboundJoint();
+			joint->setParentPose(parentPose.getInverse() * jointPose);
+			joint->setChildPose(linkPose.getInverse() * jointPose);
+			joint->setSwingLimit(swingLimit, swingLimit);
+			joint->setSwingLimitEnabled(true);
+		}
+		else
+		{
+			// Articulation roots can't be attached directly, so the first link hangs from the anchor by a spherical joint
+			PxTransform anchorLocal = (anchor != nullptr) ? anchor->getGlobalPose().getInverse() * jointPose : jointPose;
+			PxSphericalJoint *joint = PxSphericalJointCreate(*physics, anchor, anchorLocal, link, linkPose.getInverse() * jointPose);
+			joint->setLimitCone(PxJointLimitCone(swingLimit, swingLimit));
+			joint->setSphericalJointFlag(PxSphericalJointFlag::eLIMIT_ENABLED, true);
+		}
+		parent = link;
+		parentPose = linkPose;
+	}
+	if ((aggregate == nullptr) || !aggregate->addArticulation(*articulation))
+		scene->addArticulation(*articulation);
+	return articulation;
+}
+#pragma endregion
+
 #pragma region PhysX Geometries
 PxSphereGeometry PhysicsEngine::createSphereGeometry(PxReal radius)
 {
@@ -250,21 +792,116 @@ PxSphereGeometry PhysicsEngine::createSphereGeometry(PxReal radius)
 	return PxSphereGeometry(radius);
 }
 
-PxConvexMesh *PhysicsEngine::createConvexMesh(PxVec3 *pointCloud, PxU32 numVertices)
+ConvexCookingOptions::ConvexCookingOptions():
+	vertexLimit(256),
+	polygonLimit(0),
+	inflate(false),
+	skinWidth(0.025f),
+	quantization(0.0f)
+{
+}
+
+PxConvexMesh *PhysicsEngine::createConvexMesh(PxVec3 *pointCloud, PxU32 numVertices, const ConvexCookingOptions &options)
 {
 	unique_lock<mutex> lock(engineMutex);
 	if ((physics == nullptr) || (cooking == nullptr))
 		return nullptr;
-	PxConvexMeshDesc meshDesc;
-	meshDesc.flags = PxConvexFlag::eCOMPUTE_CONVEX;
-	meshDesc.vertexLimit = 256;
-	meshDesc.points.count = numVertices;
-	meshDesc.points.data = pointCloud;
-	meshDesc.points.stride = sizeof(PxVec3);
-	PxDefaultMemoryOutputStream buf;
-	if (!cooking->cookConvexMesh(meshDesc, buf))
-		return nullptr;
-	return physics->createConvexMesh(PxDefaultMemoryInputData(buf.getData(), buf.getSize()));
+	return cookConvexMesh(pointCloud, numVertices, options);
+}
+
+ConvexHullSet PhysicsEngine::createConvexHullSet(PxVec3 *pointCloud, PxU32 numVertices, const ConvexCookingOptions *levels, PxU32 numLevels)
+{
+	unique_lock<mutex> lock(engineMutex);
+	ConvexHullSet hulls;
+	if ((physics == nullptr) || (cooking == nullptr) || (levels == nullptr))
+		return hulls;
+	for (PxU32 i = 0; i < numLevels; i++)
+	{
+		PxConvexMesh *mesh = cookConvexMesh(pointCloud, numVertices, levels[i]);
+		if (mesh)
+			hulls.levels.push_back(mesh);
+	}
+	return hulls;
+}
+
+PxConvexMesh *PhysicsEngine::cookConvexMesh(const PxVec3 *pointCloud, PxU32 numVertices, const ConvexCookingOptions &options)
+{
+	vector<PxVec3> quantized;
+	if (options.quantization > 0.0f)
+	{
+		quantizePointCloud(pointCloud, numVertices, options.quantization, quantized);
+		pointCloud = quantized.data();
+		numVertices = PxU32(quantized.size());
+	}
+
+	// Cooking is shared between engines, and its parameters are changed while cooking
+	unique_lock<mutex> sdkLock(sdkMutex);
+	PxCookingParams params = cooking->getParams();
+	if (options.inflate)
+	{
+		PxCookingParams inflated = params;
+		inflated.skinWidth = options.skinWidth;
+		cooking->setParams(inflated);
+	}
+
+	PxConvexMesh *mesh = nullptr;
+	PxU32 vertexLimit = PxClamp(options.vertexLimit, 4u, 256u);
+	while (true)
+	{
+		PxConvexMeshDesc meshDesc;
+		meshDesc.flags = PxConvexFlag::eCOMPUTE_CONVEX;
+		if (options.inflate)
+			meshDesc.flags |= PxConvexFlag::eINFLATE_CONVEX;
+		meshDesc.vertexLimit = vertexLimit;
+		meshDesc.points.count = numVertices;
+		meshDesc.points.data = pointCloud;
+		meshDesc.points.stride = sizeof(PxVec3);
+		PxDefaultMemoryOutputStream buf;
+		if (!cooking->cookConvexMesh(meshDesc, buf))
+			break;
+		mesh = physics->createConvexMesh(PxDefaultMemoryInputData(buf.getData(), buf.getSize()));
+
+		// Cooking can only limit vertices, so keep dropping the vertex limit until the face count fits
+		if ((mesh == nullptr) || (options.polygonLimit == 0) || (mesh->getNbPolygons() <= options.polygonLimit) || (vertexLimit == 4))
+			break;
+		mesh->release();
+		mesh = nullptr;
+		vertexLimit = PxMax(4u, (vertexLimit * 3) / 4);
+	}
+
+	if (options.inflate)
+		cooking->setParams(params);
+	return mesh;
+}
+
+void PhysicsEngine::quantizePointCloud(const PxVec3 *pointCloud, PxU32 numVertices, PxReal cellSize, vector<PxVec3> &quantized)
+{
+	// Points sharing a cell are replaced by their average
+	unordered_map<uint64_t, PxU32> cells;
+	vector<PxU32> counts;
+	quantized.clear();
+	for (PxU32 i = 0; i < numVertices; i++)
+	{
+		const PxVec3 &p = pointCloud[i];
+		uint64_t x = uint64_t(int64_t(floorf(p.x / cellSize)) & 0x1FFFFF);
+		uint64_t y = uint64_t(int64_t(floorf(p.y / cellSize)) & 0x1FFFFF);
+		uint64_t z = uint64_t(int64_t(floorf(p.z / cellSize)) & 0x1FFFFF);
+		uint64_t key = (x << 42) | (y << 21) | z;
+		unordered_map<uint64_t, PxU32>::iterator it = cells.find(key);
+		if (it == cells.end())
+		{
+			cells.insert(make_pair(key, PxU32(quantized.size())));
+			quantized.push_back(p);
+			counts.push_back(1);
+		}
+		else
+		{
+			quantized[it->second] += p;
+			counts[it->second]++;
+		}
+	}
+	for (size_t i = 0; i < quantized.size(); i++)
+		quantized[i] *= 1.0f / PxReal(counts[i]);
 }
 
 PxConvexMeshGeometry PhysicsEngine::createConvexMeshGeometry(PxConvexMesh &mesh)
@@ -275,18 +912,27 @@ PxConvexMeshGeometry PhysicsEngine::createConvexMeshGeometry(PxConvexMesh &mesh)
 	return geometry;
 }
 
-PxConvexMeshGeometry PhysicsEngine::createConvexMeshGeometry(PxVec3 *pointCloud, PxU32 numVertices)
+PxConvexMeshGeometry PhysicsEngine::createConvexMeshGeometry(PxVec3 *pointCloud, PxU32 numVertices, const ConvexCookingOptions &options)
 {
 	unique_lock<mutex> lock(engineMutex);
 	PxConvexMeshGeometry geometry;
 	lock.unlock();
-	PxConvexMesh *mesh = createConvexMesh(pointCloud, numVertices);
+	PxConvexMesh *mesh = createConvexMesh(pointCloud, numVertices, options);
 	lock.lock();
 	if (mesh)
 		geometry.convexMesh = mesh;
 	return geometry;
 }
 
+PxConvexMeshGeometry PhysicsEngine::createConvexMeshGeometry(const ConvexHullSet &hulls, PxU32 level)
+{
+	unique_lock<mutex> lock(engineMutex);
+	PxConvexMeshGeometry geometry;
+	if (!hulls.levels.empty())
+		geometry.convexMesh = hulls.levels[PxMin(level, PxU32(hulls.levels.size() - 1))];
+	return geometry;
+}
+
 PxCapsuleGeometry PhysicsEngine::createCapsuleGeometry(PxReal radius, PxReal halfHeight)
 {
 	unique_lock<mutex> lock(engineMutex);
@@ -307,6 +953,7 @@ PxHeightField *PhysicsEngine::createHeightField(PxHeightFieldSample *field, uint
 	heightfieldDesc.convexEdgeThreshold = convexEdgeThreshold;
 	heightfieldDesc.thickness = thickness;
 	PxDefaultMemoryOutputStream buf;
+	unique_lock<mutex> sdkLock(sdkMutex);
 	if (!cooking->cookHeightField(heightfieldDesc, buf))
 		return nullptr;
 	return physics->createHeightField(PxDefaultMemoryInputData(buf.getData(), buf.getSize()));
@@ -320,19 +967,115 @@ PxHeightFieldGeometry PhysicsEngine::createHeightFieldGeometry(PxHeightField *he
 	return geom;
 }
 
-PxTriangleMesh *PhysicsEngine::createTriangleMesh(PxVec3 *vertices, PxU32 numVertices, PxU32 *indices, PxU32 numIndices)
+TriangleMeshCookingOptions::TriangleMeshCookingOptions():
+	cleanMesh(true),
+	weldTolerance(0.0f),
+	precomputeActiveEdges(true),
+	cookingHint(PxMeshCookingHint::eSIM_PERFORMANCE),
+	sizePerformanceTradeOff(0.55f)
+{
+}
+
+PxTriangleMesh *PhysicsEngine::createTriangleMesh(PxVec3 *vertices, PxU32 numVertices, PxU32 *indices, PxU32 numIndices, const TriangleMeshCookingOptions &options, TriangleMeshCookReport *report)
+{
+	unique_lock<mutex> lock(engineMutex);
+	return cookTriangleMesh(vertices, numVertices, indices, false, numIndices, options, report);
+}
+
+PxTriangleMesh *PhysicsEngine::createTriangleMesh(PxVec3 *vertices, PxU32 numVertices, PxU16 *indices, PxU32 numIndices, const TriangleMeshCookingOptions &options, TriangleMeshCookReport *report)
+{
+	unique_lock<mutex> lock(engineMutex);
+	return cookTriangleMesh(vertices, numVertices, indices, true, numIndices, options, report);
+}
+
+PxTriangleMesh *PhysicsEngine::createTriangleMesh(const ImportedMesh &mesh, const TriangleMeshCookingOptions &options, TriangleMeshCookReport *report)
 {
+	unique_lock<mutex> lock(engineMutex);
+	return cookTriangleMesh(mesh.getVertices(), mesh.getNumVertices(), mesh.getIndices(), mesh.hasIndices16Bit(), mesh.getNumIndices(), options, report);
+}
+
+PxTriangleMesh *PhysicsEngine::cookTriangleMesh(const PxVec3 *vertices, PxU32 numVertices, const void *indices, bool indices16Bit, PxU32 numIndices, const TriangleMeshCookingOptions &options, TriangleMeshCookReport *report)
+{
+	TriangleMeshCookReport result;
+	result.success = false;
+	result.inputVertices = numVertices;
+	result.inputTriangles = numIndices / 3;
+	result.vertices = 0;
+	result.triangles = 0;
+	result.indices16Bit = false;
+	result.cookTime = 0.0f;
+	result.cookedSize = 0;
+	if (report != nullptr)
+		*report = result;
+
+	if ((physics == nullptr) || (cooking == nullptr))
+		return nullptr;
+	if ((vertices == nullptr) || (indices == nullptr) || (numVertices == 0) || (numIndices == 0) || (numIndices % 3 != 0))
+	{
+		printf("Error: createTriangleMesh needs a whole number of triangles (got %u indices for %u vertices)\n", numIndices, numVertices);
+		return nullptr;
+	}
+	for (PxU32 i = 0; i < numIndices; i++)
+	{
+		PxU32 index = indices16Bit ? PxU32(((const PxU16*)indices)[i]) : ((const PxU32*)indices)[i];
+		if (index >= numVertices)
+		{
+			printf("Error: createTriangleMesh index %u is %u, but there are only %u vertices\n", i, index, numVertices);
+			return nullptr;
+		}
+	}
+
+	unique_lock<mutex> sdkLock(sdkMutex);
+	PxCookingParams defaults = cooking->getParams();
+	PxCookingParams params = defaults;
+	params.meshPreprocessParams = PxMeshPreprocessingFlags();
+	if (!options.cleanMesh)
+		params.meshPreprocessParams |= PxMeshPreprocessingFlag::eDISABLE_CLEAN_MESH;
+	else if (options.weldTolerance > 0.0f)
+	{
+		params.meshPreprocessParams |= PxMeshPreprocessingFlag::eWELD_VERTICES;
+		params.meshWeldTolerance = options.weldTolerance;
+	}
+	if (!options.precomputeActiveEdges)
+		params.meshPreprocessParams |= PxMeshPreprocessingFlag::eDISABLE_ACTIVE_EDGES_PRECOMPUTE;
+	params.meshCookingHint = options.cookingHint;
+	params.meshSizePerformanceTradeOff = PxClamp(options.sizePerformanceTradeOff, 0.0f, 1.0f);
+	cooking->setParams(params);
+
 	PxTriangleMeshDesc meshDesc;
-	meshDesc.points.count = numIndices;
+	meshDesc.points.count = numVertices;
 	meshDesc.points.data = vertices;
 	meshDesc.points.stride = sizeof(PxVec3);
 	meshDesc.triangles.count = numIndices / 3;
 	meshDesc.triangles.data = indices;
-	meshDesc.triangles.stride = 3 * sizeof(PxU32);
+	if (indices16Bit)
+	{
+		meshDesc.triangles.stride = 3 * sizeof(PxU16);
+		meshDesc.flags |= PxMeshFlag::e16_BIT_INDICES;
+	}
+	else
+		meshDesc.triangles.stride = 3 * sizeof(PxU32);
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
 	PxDefaultMemoryOutputStream buf;
-	if (!cooking->cookTriangleMesh(meshDesc, buf))
+	bool cooked = cooking->cookTriangleMesh(meshDesc, buf);
+	cooking->setParams(defaults);
+	if (!cooked)
 		return nullptr;
-	return physics->createTriangleMesh(PxDefaultMemoryInputData(buf.getData(), buf.getSize()));
+	PxTriangleMesh *mesh = physics->createTriangleMesh(PxDefaultMemoryInputData(buf.getData(), buf.getSize()));
+	result.cookTime = chrono::duration<PxReal>(chrono::high_resolution_clock::now() - start).count();
+
+	if (mesh != nullptr)
+	{
+		result.success = true;
+		result.vertices = mesh->getNbVertices();
+		result.triangles = mesh->getNbTriangles();
+		result.indices16Bit = mesh->getTriangleMeshFlags() & PxTriangleMeshFlag::eHAS_16BIT_TRIANGLE_INDICES;
+		result.cookedSize = buf.getSize();
+	}
+	if (report != nullptr)
+		*report = result;
+	return mesh;
 }
 
 PxTriangleMeshGeometry PhysicsEngine::createTriangleMeshGeometry(PxTriangleMesh* mesh)
@@ -344,33 +1087,1446 @@ PxTriangleMeshGeometry PhysicsEngine::createTriangleMeshGeometry(PxTriangleMesh*
 }
 #pragma endregion
 
-void PhysicsEngine::setGravity(vec3 gravity)
+void PhysicsEngine::setFrequency(uint32_t frequency)
 {
 	unique_lock<mutex> lock(engineMutex);
-	if (scene != nullptr)
-	{
-		scene->setGravity(gravity);
-	}
+	if (frequency == 0)
+		return;
+	engineFrequency = frequency;
+	simulationPeriod = 1.0f / float(engineFrequency);
 }
 
-#pragma region Common Inertia Tensors
-vec3 PhysicsEngine::InertiaTensorSolidSphere(PxReal radius, PxReal mass)
+#pragma region Step Rate Governor
+void PhysicsEngine::updateGovernor(PxReal stepTime)
 {
-	return vec3((mass*radius*radius)*0.4f);
-}
+	// The fastest body relative to its own size decides how often the scene must be stepped to stay stable
+	PxReal maxSpeedRatio = 0.0f;
+	for (size_t i = 0; i < dynamicActors.size(); i++)
+	{
+		PxRigidDynamic *actor = (PxRigidDynamic*)dynamicActors[i];
+		if (actor->isSleeping() || (actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC))
+			continue;
+		PxVec3 extents = actor->getWorldBounds().getDimensions();
+		PxReal size = PxMax(PxMin(extents.x, PxMin(extents.y, extents.z)), 0.01f);
+		maxSpeedRatio = PxMax(maxSpeedRatio, actor->getLinearVelocity().magnitude() / size);
+	}
 
-vec3 PhysicsEngine::InertiaTensorHollowSphere(PxReal radius, PxReal mass)
-{
-	return vec3((mass*radius*radius)*(0.2f/0.3f));
-}
+	PxU32 contactPairs = simulationStats.nbDiscreteContactPairsWithContacts;
 
-vec3 PhysicsEngine::InertiaTensorSolidCube(PxReal width, PxReal mass)
-{
-	return vec3((mass*width*width)/6.0f);
-}
+	GovernorDecision decision;
+	decision.step = stepCount;
+	decision.previousFrequency = engineFrequency;
+	decision.reason = GovernorDecision::Steady;
+	decision.maxSpeedRatio = maxSpeedRatio;
+	decision.contactPairs = contactPairs;
+	decision.stepTime = stepTime;
 
-vec3 PhysicsEngine::InertiaTensorSolidCapsule(PxReal radius, PxReal halfHeight, PxReal mass)
-{
+	PxReal current = PxReal(engineFrequency);
+	PxReal required = maxSpeedRatio / governorMaxTravel;
+	PxReal frequency = current;
+	if (required > current)
+	{
+		frequency = required;
+		decision.reason = GovernorDecision::Speed;
+	}
+	else if ((governorContactAverage > 0.0f) && (PxReal(contactPairs) > governorContactAverage * governorContactSpike))
+	{
+		frequency = current * 1.5f;
+		decision.reason = GovernorDecision::ContactSpike;
+	}
+	else if (required < current * 0.5f)
+	{
+		// Back off gradually so the rate doesn't oscillate
+		frequency = PxMax(required, current * 0.9f);
+		decision.reason = GovernorDecision::Calm;
+	}
+	if (stepTime > governorBudget * simulationPeriod)
+	{
+		// Keeping up with real time takes priority over accuracy
+		frequency = PxMin(frequency, current * 0.75f);
+		decision.reason = GovernorDecision::OverBudget;
+	}
+	governorContactAverage = (governorContactAverage == 0.0f) ? PxReal(contactPairs) : (0.9f * governorContactAverage + 0.1f * PxReal(contactPairs));
+
+	// Clamp before converting, since a fast enough body asks for more steps than a uint32_t can hold
+	frequency = PxClamp(frequency, PxReal(governorMinFrequency), PxReal(governorMaxFrequency));
+	engineFrequency = PxClamp(uint32_t(frequency + 0.5f), governorMinFrequency, governorMaxFrequency);
+	simulationPeriod = 1.0f / PxReal(engineFrequency);
+	decision.frequency = engineFrequency;
+	if (decision.frequency == decision.previousFrequency)
+		decision.reason = GovernorDecision::Steady;
+	lastDecision = decision;
+	if (governorCallback)
+		governorCallback(decision);
+}
+
+void PhysicsEngine::setGovernorEnabled(bool enabled)
+{
+	unique_lock<mutex> lock(engineMutex);
+	governorEnabled = enabled;
+}
+
+void PhysicsEngine::setGovernorCallback(function<void(const GovernorDecision&)> callback)
+{
+	unique_lock<mutex> lock(engineMutex);
+	governorCallback = callback;
+}
+
+GovernorDecision PhysicsEngine::getGovernorDecision()
+{
+	unique_lock<mutex> lock(engineMutex);
+	return lastDecision;
+}
+#pragma endregion
+
+#pragma region Force Fields
+ForceField::ForceField():
+	type(Wind),
+	bounds(PxBounds3::empty()),
+	velocity(0.0f),
+	center(0.0f),
+	axis(0.0f, 1.0f, 0.0f),
+	strength(0.0f),
+	radius(0.0f),
+	drag(0.0f)
+{
+}
+
+ForceField ForceField::wind(const PxBounds3 &bounds, PxVec3 velocity, PxReal drag)
+{
+	ForceField field;
+	field.type = Wind;
+	field.bounds = bounds;
+	field.velocity = velocity;
+	field.drag = drag;
+	return field;
+}
+
+ForceField ForceField::vortex(PxVec3 center, PxVec3 axis, PxReal speed, PxReal radius, PxReal height, PxReal drag)
+{
+	ForceField field;
+	field.type = Vortex;
+	field.center = center;
+	field.axis = axis.getNormalized();
+	field.strength = speed;
+	field.radius = radius;
+	field.drag = drag;
+	// The bounds hold the cylinder of the given height centered on center
+	PxVec3 halfAxis = field.axis * (0.5f * height);
+	PxVec3 extents(PxAbs(halfAxis.x) + radius, PxAbs(halfAxis.y) + radius, PxAbs(halfAxis.z) + radius);
+	field.bounds = PxBounds3::centerExtents(center, extents);
+	return field;
+}
+
+ForceField ForceField::explosion(PxVec3 center, PxReal impulse, PxReal radius)
+{
+	ForceField field;
+	field.type = Explosion;
+	field.center = center;
+	field.strength = impulse;
+	field.radius = radius;
+	field.bounds = PxBounds3::centerExtents(center, PxVec3(radius));
+	return field;
+}
+
+ForceField ForceField::buoyancy(const PxBounds3 &bounds, PxVec3 surfacePoint, PxVec3 surfaceNormal, PxReal density, PxReal damping)
+{
+	ForceField field;
+	field.type = Buoyancy;
+	field.bounds = bounds;
+	field.center = surfacePoint;
+	field.axis = surfaceNormal.getNormalized();
+	field.strength = density;
+	field.drag = damping;
+	return field;
+}
+
+PxVec3 ForceField::getAirVelocity(const PxVec3 &point) const
+{
+	if (type == Wind)
+		return velocity;
+	if (type != Vortex)
+		return PxVec3(0.0f);
+	PxVec3 offset = point - center;
+	PxVec3 radial = offset - axis * axis.dot(offset);
+	PxReal distance = radial.magnitude();
+	if ((distance <= 1e-3f) || (distance >= radius))
+		return PxVec3(0.0f);
+	return axis.cross(radial) * (strength * (1.0f - distance / radius) / distance);
+}
+
+uint64_t PhysicsEngine::forceFieldCell(const PxVec3 &point) const
+{
+	// 21 bits per axis, wrapping, so distant cells may share a list (the bounds test sorts them out)
+	uint64_t x = uint64_t(int64_t(PxFloor(point.x / forceFieldCellSize))) & 0x1fffff;
+	uint64_t y = uint64_t(int64_t(PxFloor(point.y / forceFieldCellSize))) & 0x1fffff;
+	uint64_t z = uint64_t(int64_t(PxFloor(point.z / forceFieldCellSize))) & 0x1fffff;
+	return (x << 42) | (y << 21) | z;
+}
+
+void PhysicsEngine::buildForceFieldGrid()
+{
+	forceFieldGrid.clear();
+	globalForceFields.clear();
+	for (PxU32 i = 0; i < forceFields.size(); i++)
+	{
+		const PxBounds3 &bounds = forceFields[i].bounds;
+		if (bounds.isEmpty())
+			continue;
+		PxVec3 lo = bounds.minimum / forceFieldCellSize, hi = bounds.maximum / forceFieldCellSize;
+		PxReal cells = (PxFloor(hi.x) - PxFloor(lo.x) + 1.0f) * (PxFloor(hi.y) - PxFloor(lo.y) + 1.0f) * (PxFloor(hi.z) - PxFloor(lo.z) + 1.0f);
+		if (!(cells <= 4096.0f))
+		{
+			globalForceFields.push_back(i);
+			continue;
+		}
+		for (PxReal x = PxFloor(lo.x); x <= hi.x; x += 1.0f)
+			for (PxReal y = PxFloor(lo.y); y <= hi.y; y += 1.0f)
+				for (PxReal z = PxFloor(lo.z); z <= hi.z; z += 1.0f)
+					forceFieldGrid[forceFieldCell(PxVec3(x + 0.5f, y + 0.5f, z + 0.5f) * forceFieldCellSize)].push_back(i);
+	}
+	forceFieldGridDirty = false;
+}
+
+void PhysicsEngine::gatherForceFields(const PxVec3 &point)
+{
+	forceFieldCandidates.clear();
+	unordered_map<uint64_t, vector<PxU32>>::const_iterator cell = forceFieldGrid.find(forceFieldCell(point));
+	if (cell != forceFieldGrid.end())
+	{
+		for (size_t i = 0; i < cell->second.size(); i++)
+			if (forceFields[cell->second[i]].bounds.contains(point))
+				forceFieldCandidates.push_back(cell->second[i]);
+	}
+	for (size_t i = 0; i < globalForceFields.size(); i++)
+		if (forceFields[globalForceFields[i]].bounds.contains(point))
+			forceFieldCandidates.push_back(globalForceFields[i]);
+}
+
+PxVec3 PhysicsEngine::sampleAirVelocity(const PxVec3 &point)
+{
+	if (forceFieldGridDirty)
+		buildForceFieldGrid();
+	gatherForceFields(point);
+	PxVec3 air(0.0f);
+	for (size_t i = 0; i < forceFieldCandidates.size(); i++)
+		air += forceFields[forceFieldCandidates[i]].getAirVelocity(point);
+	return air;
+}
+
+void PhysicsEngine::applyForceFields()
+{
+	if (forceFieldGridDirty)
+		buildForceFieldGrid();
+
+	PxVec3 gravity = scene->getGravity();
+	for (size_t i = 0; i < dynamicActors.size(); i++)
+	{
+		PxRigidDynamic *actor = (PxRigidDynamic*)dynamicActors[i];
+		if (actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC)
+			continue;
+		PxBounds3 bounds = actor->getWorldBounds();
+		PxVec3 position = bounds.getCenter();
+		gatherForceFields(position);
+		if (forceFieldCandidates.empty())
+			continue;
+
+		bool sleeping = actor->isSleeping();
+		bool aerodynamic = aeroLookup.count(actor) > 0;
+		PxVec3 extents = bounds.getExtents();
+		PxVec3 velocity = actor->getLinearVelocity();
+		PxVec3 force(0.0f);
+		for (size_t j = 0; j < forceFieldCandidates.size(); j++)
+		{
+			const ForceField &field = forceFields[forceFieldCandidates[j]];
+			switch (field.type)
+			{
+			case ForceField::Explosion:
+			{
+				// Explosions wake what they hit
+				PxVec3 offset = position - field.center;
+				PxReal distance = offset.magnitude();
+				if ((distance < field.radius) && (distance > 1e-3f))
+					actor->addForce(offset * (field.strength * (1.0f - distance / field.radius) / distance), PxForceMode::eIMPULSE);
+				break;
+			}
+			case ForceField::Buoyancy:
+			{
+				if (sleeping)
+					break;
+				// Bodies are treated as their bounding boxes: the submerged fraction is how far the box is below the surface
+				PxReal halfHeight = PxAbs(field.axis.x) * extents.x + PxAbs(field.axis.y) * extents.y + PxAbs(field.axis.z) * extents.z;
+				PxReal depth = field.axis.dot(field.center - position);
+				PxReal submerged = (halfHeight > 0.0f) ? PxClamp((depth + halfHeight) / (2.0f * halfHeight), 0.0f, 1.0f) : 0.0f;
+				if (submerged <= 0.0f)
+					break;
+				PxReal volume = 8.0f * extents.x * extents.y * extents.z * submerged;
+				force += -gravity * (field.strength * volume) - velocity * (field.drag * submerged * actor->getMass());
+				break;
+			}
+			case ForceField::Wind:
+			case ForceField::Vortex:
+				// Aerodynamic actors feel moving air through their own lift and drag
+				if (!sleeping && !aerodynamic && (field.drag > 0.0f))
+				{
+					PxVec3 relative = velocity - field.getAirVelocity(position);
+					PxReal area = 4.0f * (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x) / 3.0f;
+					force -= relative * (0.5f * airDensity * field.drag * area * relative.magnitude());
+				}
+				break;
+			}
+		}
+		if (!force.isZero())
+			actor->addForce(force, PxForceMode::eFORCE, false);
+	}
+
+	// Explosions only last one step
+	for (size_t i = forceFields.size(); i-- > 0;)
+	{
+		if (forceFields[i].type == ForceField::Explosion)
+		{
+			forceFields.erase(forceFields.begin() + i);
+			forceFieldHandles.erase(forceFieldHandles.begin() + i);
+			forceFieldGridDirty = true;
+		}
+	}
+}
+
+PxU32 PhysicsEngine::addForceField(const ForceField &field)
+{
+	unique_lock<mutex> lock(engineMutex);
+	forceFields.push_back(field);
+	forceFieldHandles.push_back(nextForceFieldHandle);
+	forceFieldGridDirty = true;
+	return nextForceFieldHandle++;
+}
+
+void PhysicsEngine::removeForceField(PxU32 handle)
+{
+	unique_lock<mutex> lock(engineMutex);
+	vector<PxU32>::iterator it = find(forceFieldHandles.begin(), forceFieldHandles.end(), handle);
+	if (it == forceFieldHandles.end())
+		return;
+	forceFields.erase(forceFields.begin() + (it - forceFieldHandles.begin()));
+	forceFieldHandles.erase(it);
+	forceFieldGridDirty = true;
+}
+#pragma endregion
+
+#pragma region Checkpoints
+uint64_t PhysicsEngine::checkpoint()
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return 0;
+	Checkpoint &saved = checkpoints[checkpointNext];
+	saved.step = stepCount;
+	saved.bodies.clear();
+
+	PxU32 numDynamic = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC);
+	queryActors.resize(numDynamic);
+	if (numDynamic > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC, &queryActors[0], numDynamic);
+	for (PxU32 i = 0; i < numDynamic; i++)
+		saved.bodies.push_back((PxRigidDynamic*)queryActors[i]);
+	PxU32 numDynamicBodies = PxU32(saved.bodies.size());
+	PxU32 numArticulations = scene->getNbArticulations();
+	publishArticulations.resize(numArticulations);
+	if (numArticulations > 0)
+		scene->getArticulations(&publishArticulations[0], numArticulations);
+	for (PxU32 i = 0; i < numArticulations; i++)
+	{
+		PxU32 numLinks = publishArticulations[i]->getNbLinks();
+		publishLinks.resize(numLinks);
+		if (numLinks > 0)
+			publishArticulations[i]->getLinks(&publishLinks[0], numLinks);
+		saved.bodies.insert(saved.bodies.end(), publishLinks.begin(), publishLinks.end());
+	}
+
+	size_t numBodies = saved.bodies.size();
+	saved.poses.resize(numBodies);
+	saved.linearVelocities.resize(numBodies);
+	saved.angularVelocities.resize(numBodies);
+	saved.kinematicTargets.resize(numBodies);
+	saved.flags.resize(numBodies);
+	for (size_t i = 0; i < numBodies; i++)
+	{
+		PxRigidBody *body = saved.bodies[i];
+		saved.poses[i] = body->getGlobalPose();
+		saved.linearVelocities[i] = body->getLinearVelocity();
+		saved.angularVelocities[i] = body->getAngularVelocity();
+		saved.flags[i] = 0;
+		if (i < numDynamicBodies)
+		{
+			PxRigidDynamic *actor = (PxRigidDynamic*)body;
+			saved.flags[i] |= CheckpointDynamic;
+			if (actor->isSleeping())
+				saved.flags[i] |= CheckpointSleeping;
+			if (actor->getKinematicTarget(saved.kinematicTargets[i]))
+				saved.flags[i] |= CheckpointKinematicTarget;
+		}
+	}
+
+	// Kept by actor, since motions and aerodynamic actors can be added and removed before the checkpoint is restored
+	saved.aeroCoefficients.clear();
+	for (size_t i = 0; i < aeroActors.size(); i++)
+		saved.aeroCoefficients[aeroActors[i].actor] = PxVec3(aeroActors[i].LiftCoefficient, aeroActors[i].DragCoefficient, aeroActors[i].SurfaceArea);
+	saved.kinematicTimes.clear();
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+		saved.kinematicTimes[kinematicAnimations[i].actor] = kinematicAnimations[i].time;
+	saved.lodStates = lodStates;
+
+	checkpointNext = (checkpointNext + 1) % checkpoints.size();
+	checkpointCount = PxMin(checkpointCount + 1, checkpoints.size());
+	return saved.step;
+}
+
+bool PhysicsEngine::restore(uint64_t step)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return false;
+	const Checkpoint *saved = nullptr;
+	for (size_t i = 0; i < checkpointCount; i++)
+	{
+		const Checkpoint &candidate = checkpoints[(checkpointNext + checkpoints.size() - 1 - i) % checkpoints.size()];
+		if (candidate.step == step)
+		{
+			saved = &candidate;
+			break;
+		}
+	}
+	if (saved == nullptr)
+		return false;
+
+	// Bodies released since the checkpoint (removed characters, for one) are skipped rather than touched
+	liveBodies.clear();
+	PxU32 numDynamic = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC);
+	queryActors.resize(numDynamic);
+	if (numDynamic > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC, &queryActors[0], numDynamic);
+	for (PxU32 i = 0; i < numDynamic; i++)
+		liveBodies.insert((PxRigidDynamic*)queryActors[i]);
+	PxU32 numArticulations = scene->getNbArticulations();
+	publishArticulations.resize(numArticulations);
+	if (numArticulations > 0)
+		scene->getArticulations(&publishArticulations[0], numArticulations);
+	for (PxU32 i = 0; i < numArticulations; i++)
+	{
+		PxU32 numLinks = publishArticulations[i]->getNbLinks();
+		publishLinks.resize(numLinks);
+		if (numLinks > 0)
+			publishArticulations[i]->getLinks(&publishLinks[0], numLinks);
+		liveBodies.insert(publishLinks.begin(), publishLinks.end());
+	}
+
+	// Bodies frozen at the checkpoint must be kinematic again before their state is restored, and ones frozen since thawed
+	restoreLodStates(saved->lodStates);
+
+	for (size_t i = 0; i < saved->bodies.size(); i++)
+	{
+		PxRigidBody *body = saved->bodies[i];
+		if (liveBodies.find(body) == liveBodies.end())
+			continue;
+		uint8_t flags = saved->flags[i];
+		body->setGlobalPose(saved->poses[i], false);
+		if (!(flags & CheckpointDynamic))
+		{
+			body->setLinearVelocity(saved->linearVelocities[i]);
+			body->setAngularVelocity(saved->angularVelocities[i]);
+			continue;
+		}
+		PxRigidDynamic *actor = (PxRigidDynamic*)body;
+		if (actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC)
+		{
+			if (flags & CheckpointKinematicTarget)
+				actor->setKinematicTarget(saved->kinematicTargets[i]);
+			continue;
+		}
+		actor->setLinearVelocity(saved->linearVelocities[i], false);
+		actor->setAngularVelocity(saved->angularVelocities[i], false);
+		if (flags & CheckpointSleeping)
+			actor->putToSleep();
+		else
+			actor->wakeUp();
+	}
+
+	// Actors added since the checkpoint keep their current values
+	for (size_t i = 0; i < aeroActors.size(); i++)
+	{
+		unordered_map<PxRigidDynamic*, PxVec3>::const_iterator coefficients = saved->aeroCoefficients.find(aeroActors[i].actor);
+		if (coefficients == saved->aeroCoefficients.end())
+			continue;
+		aeroActors[i].LiftCoefficient = coefficients->second.x;
+		aeroActors[i].DragCoefficient = coefficients->second.y;
+		aeroActors[i].SurfaceArea = coefficients->second.z;
+	}
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+	{
+		unordered_map<PxRigidDynamic*, double>::const_iterator time = saved->kinematicTimes.find(kinematicAnimations[i].actor);
+		if (time != saved->kinematicTimes.end())
+			kinematicAnimations[i].time = time->second;
+	}
+	stepCount = saved->step;
+	return true;
+}
+
+void PhysicsEngine::step(PxU32 count)
+{
+	for (PxU32 i = 0; i < count; i++)
+		update();
+}
+#pragma endregion
+
+#pragma region Debris
+void PhysicsEngine::updateDebris(PxReal period)
+{
+	// Debris is spawned in order, so the oldest is always at the tail
+	while ((debrisCount > 0) && (debrisLifetime > 0.0f) && (debrisAges[debrisTail] + period > debrisLifetime))
+	{
+		debrisTail = (debrisTail + 1) % debrisBudget;
+		debrisCount--;
+	}
+
+	// Moving debris casts a ray along its motion for the step; debris that has come to rest stays put
+	PxVec3 gravity = scene->getGravity();
+	PxU32 numQueries = 0;
+	for (PxU32 i = 0; i < debrisCount; i++)
+	{
+		PxU32 index = (debrisTail + i) % debrisBudget;
+		debrisAges[index] += period;
+		debrisPreviousPositions[index] = debrisPositions[index];
+		if (debrisResting[index])
+			continue;
+		debrisVelocities[index] += gravity * period;
+		PxVec3 motion = debrisVelocities[index] * period;
+		PxReal distance = motion.magnitude();
+		if (distance < 1e-6f)
+			continue;
+		debrisQuery->raycast(debrisPositions[index], motion / distance, distance + debrisRadii[index], 0, PxHitFlag::ePOSITION | PxHitFlag::eNORMAL | PxHitFlag::eDISTANCE, PxQueryFilterData(PxQueryFlag::eSTATIC));
+		debrisQueried[numQueries++] = index;
+	}
+	if (numQueries == 0)
+		return;
+	debrisQuery->execute();
+
+	for (PxU32 i = 0; i < numQueries; i++)
+	{
+		PxU32 index = debrisQueried[i];
+		PxVec3 &velocity = debrisVelocities[index];
+		const PxRaycastQueryResult &result = debrisResults[i];
+		if (!result.hasBlock)
+		{
+			debrisPositions[index] += velocity * period;
+			continue;
+		}
+
+		// Stop one radius short of the surface and bounce. Debris has no spin, so friction just slows the sliding part
+		const PxRaycastHit &hit = result.block;
+		PxVec3 normal = hit.normal;
+		debrisPositions[index] = hit.position + normal * debrisRadii[index];
+		PxReal normalSpeed = velocity.dot(normal);
+		if (normalSpeed < 0.0f)
+		{
+			PxVec3 tangent = velocity - normal * normalSpeed;
+			velocity = tangent * (1.0f - debrisFriction) - normal * (normalSpeed * debrisRestitution);
+		}
+		// Debris that is barely moving against an upward facing surface comes to rest
+		if ((velocity.magnitudeSquared() < gravity.magnitudeSquared() * period * period * 4.0f) && (normal.dot(gravity) < 0.0f))
+		{
+			velocity = PxVec3(0.0f);
+			debrisResting[index] = 1;
+		}
+	}
+}
+
+void PhysicsEngine::spawnDebris(const PxVec3 *positions, const PxVec3 *velocities, PxU32 count, PxReal radius)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((debrisBudget == 0) || (positions == nullptr))
+		return;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		if (debrisCount == debrisBudget)
+		{
+			debrisTail = (debrisTail + 1) % debrisBudget;
+			debrisCount--;
+		}
+		PxU32 index = (debrisTail + debrisCount) % debrisBudget;
+		debrisPositions[index] = positions[i];
+		debrisPreviousPositions[index] = positions[i];
+		debrisVelocities[index] = (velocities != nullptr) ? velocities[i] : PxVec3(0.0f);
+		debrisRadii[index] = radius;
+		debrisAges[index] = 0.0f;
+		debrisResting[index] = 0;
+		debrisCount++;
+	}
+}
+
+PxU32 PhysicsEngine::getDebrisCount()
+{
+	unique_lock<mutex> lock(engineMutex);
+	return debrisCount;
+}
+#pragma endregion
+
+#pragma region Kinematic Motions
+KinematicMotion::KinematicMotion():
+	type(Spinner),
+	loop(true),
+	angularVelocity(0.0f)
+{
+}
+
+KinematicMotion KinematicMotion::keyframed(const KinematicKeyframe *frames, PxU32 numFrames, bool loop)
+{
+	KinematicMotion motion;
+	motion.type = Keyframes;
+	motion.keyframes.assign(frames, frames + ((frames != nullptr) ? numFrames : 0));
+	sort(motion.keyframes.begin(), motion.keyframes.end(), [](const KinematicKeyframe &a, const KinematicKeyframe &b)
+	{
+		return a.time < b.time;
+	});
+	motion.loop = loop;
+	return motion;
+}
+
+KinematicMotion KinematicMotion::spinner(PxVec3 angularVelocity)
+{
+	KinematicMotion motion;
+	motion.type = Spinner;
+	motion.angularVelocity = angularVelocity;
+	return motion;
+}
+
+KinematicMotion KinematicMotion::path(function<PxTransform(PxReal)> trajectory)
+{
+	KinematicMotion motion;
+	motion.type = Trajectory;
+	motion.trajectory = trajectory;
+	return motion;
+}
+
+PxTransform PhysicsEngine::evaluateMotion(const KinematicAnimation &animation)
+{
+	const KinematicMotion &motion = animation.motion;
+	switch (motion.type)
+	{
+	case KinematicMotion::Spinner:
+	{
+		// Evaluated from the start pose rather than accumulated, so the rotation doesn't drift
+		PxReal rate = motion.angularVelocity.magnitude();
+		if (rate <= 0.0f)
+			return animation.startPose;
+		PxReal angle = PxReal(fmod(double(rate) * animation.time, 2.0 * PxPi));
+		PxQuat q = PxQuat(angle, motion.angularVelocity / rate) * animation.startPose.q;
+		return PxTransform(animation.startPose.p, q.getNormalized());
+	}
+	case KinematicMotion::Trajectory:
+		return motion.trajectory ? motion.trajectory(PxReal(animation.time)) : animation.startPose;
+	case KinematicMotion::Keyframes:
+	{
+		const vector<KinematicKeyframe> &frames = motion.keyframes;
+		if (frames.empty())
+			return animation.startPose;
+		double time = animation.time;
+		double length = frames.back().time;
+		if (motion.loop && (length > 0.0))
+			time = fmod(time, length);
+		if (time <= frames.front().time)
+			return frames.front().pose;
+		if (time >= length)
+			return frames.back().pose;
+		size_t next = 1;
+		while (frames[next].time < time)
+			next++;
+		const KinematicKeyframe &a = frames[next - 1];
+		const KinematicKeyframe &b = frames[next];
+		PxReal alpha = (b.time > a.time) ? PxReal((time - a.time) / (b.time - a.time)) : 1.0f;
+		PxQuat qb = (a.pose.q.dot(b.pose.q) < 0.0f) ? -b.pose.q : b.pose.q;
+		PxQuat q = a.pose.q * (1.0f - alpha) + qb * alpha;
+		return PxTransform(a.pose.p + (b.pose.p - a.pose.p) * alpha, q.getNormalized());
+	}
+	}
+	return animation.startPose;
+}
+
+void PhysicsEngine::updateKinematics(PxReal period)
+{
+	// Targets are where the actors should be at the end of the coming step
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+	{
+		KinematicAnimation &animation = kinematicAnimations[i];
+		animation.time += period;
+		animation.actor->setKinematicTarget(evaluateMotion(animation));
+	}
+}
+
+void PhysicsEngine::setKinematicMotion(PxRigidDynamic *actor, const KinematicMotion &motion)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (actor == nullptr)
+		return;
+	actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, true);
+	KinematicAnimation animation;
+	animation.actor = actor;
+	animation.motion = motion;
+	animation.startPose = actor->getGlobalPose();
+	animation.time = 0.0;
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+	{
+		if (kinematicAnimations[i].actor == actor)
+		{
+			kinematicAnimations[i] = animation;
+			return;
+		}
+	}
+	kinematicAnimations.push_back(animation);
+}
+
+void PhysicsEngine::clearKinematicMotion(PxRigidDynamic *actor)
+{
+	unique_lock<mutex> lock(engineMutex);
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+	{
+		if (kinematicAnimations[i].actor == actor)
+		{
+			kinematicAnimations.erase(kinematicAnimations.begin() + i);
+			return;
+		}
+	}
+}
+#pragma endregion
+
+#pragma region Character Controllers
+PxController *PhysicsEngine::addCharacter(const vec3 &position, const PxCapsuleGeometry &capsule, Material material, PxReal stepOffset, PxReal slopeLimit)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((scene == nullptr) || !capsule.isValid())
+		return nullptr;
+
+	switch (material)
+	{
+	case Wood:
+	case HollowPVC:
+	case SolidPVC:
+	case HollowSteel:
+	case SolidSteel:
+	case Concrete:
+		break;
+	default:
+		printf("Error: addCharacter was given an unknown material (%d)\n", (int)material);
+		return nullptr;
+	}
+
+	if (controllerManager == nullptr)
+	{
+		controllerManager = PxCreateControllerManager(*scene);
+		if (controllerManager == nullptr)
+		{
+			printf("Error: PxCreateControllerManager Failed\n");
+			return nullptr;
+		}
+	}
+
+	PxCapsuleControllerDesc desc;
+	desc.position = PxExtendedVec3(position.x, position.y, position.z);
+	desc.radius = capsule.radius;
+	desc.height = capsule.halfHeight * 2.0f;
+	desc.stepOffset = PxMin(stepOffset, desc.height + desc.radius * 2.0f);
+	desc.slopeLimit = PxCos(slopeLimit);
+	desc.upDirection = scene->getGravity().isZero() ? PxVec3(0.0f, 1.0f, 0.0f) : -scene->getGravity().getNormalized();
+	desc.material = mtls[material];
+	PxController *character = controllerManager->createController(desc);
+	if (character == nullptr)
+		printf("Error: addCharacter could not create a controller (radius %f, half height %f)\n", capsule.radius, capsule.halfHeight);
+	return character;
+}
+
+void PhysicsEngine::removeCharacter(PxController *character)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((controllerManager == nullptr) || (character == nullptr))
+		return;
+
+	// The engine's lists still point at the controller's actor until the next step gathers them again
+	PxRigidDynamic *actor = character->getActor();
+	dynamicActors.erase(remove(dynamicActors.begin(), dynamicActors.end(), (PxActor*)actor), dynamicActors.end());
+	broadPhaseCallback.actors.erase(remove(broadPhaseCallback.actors.begin(), broadPhaseCallback.actors.end(), (PxActor*)actor), broadPhaseCallback.actors.end());
+	ccdActors.erase(remove(ccdActors.begin(), ccdActors.end(), actor), ccdActors.end());
+	lodStates.erase(actor);
+	for (size_t i = 0; i < kinematicAnimations.size(); i++)
+	{
+		if (kinematicAnimations[i].actor == actor)
+		{
+			kinematicAnimations.erase(kinematicAnimations.begin() + i);
+			break;
+		}
+	}
+	character->release();
+}
+
+void PhysicsEngine::moveCharacters(PxController *const *characters, const vec3 *displacements, PxU32 count, PxReal elapsedTime, PxControllerCollisionFlags *collisions)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((controllerManager == nullptr) || (characters == nullptr) || (displacements == nullptr))
+		return;
+
+	// The controller manager isn't thread safe in this PhysX version, so the moves run one after another (each sees the ones before it)
+	for (PxU32 i = 0; i < count; i++)
+	{
+		PxControllerCollisionFlags flags;
+		if (characters[i] != nullptr)
+			flags = characters[i]->move(displacements[i], 0.001f, elapsedTime, characterFilters);
+		if (collisions != nullptr)
+			collisions[i] = flags;
+	}
+}
+#pragma endregion
+
+#pragma region Static Levels
+void PhysicsEngine::loadStaticLevel(const vector<StaticLevelPiece> &pieces, bool background)
+{
+	// Only one level is built at a time. A load still in flight is waited for without the engine lock, so steps carry on meanwhile
+	unique_lock<mutex> levelLock(levelMutex);
+	thread *previous = nullptr;
+	{
+		unique_lock<mutex> lock(engineMutex);
+		if ((physics == nullptr) || (scene == nullptr))
+			return;
+		previous = levelLoader;
+		levelLoader = nullptr;
+	}
+	if (previous != nullptr)
+	{
+		previous->join();
+		delete previous;
+	}
+
+	function<void()> build = [this, pieces]()
+	{
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		vector<PxActor*> built;
+		built.reserve(pieces.size());
+		// PxPhysics guards its own object pools, so actors can be created here while other engines build theirs (see sdkMutex)
+		for (size_t i = 0; i < pieces.size(); i++)
+		{
+			const StaticLevelPiece &piece = pieces[i];
+			if ((piece.geometry.getType() == PxGeometryType::eINVALID) || (piece.material < Wood) || (piece.material > Concrete))
+				continue;
+			PxRigidStatic *actor = physics->createRigidStatic(piece.pose);
+			if (actor == nullptr)
+				continue;
+			if (actor->createShape(piece.geometry.any(), *mtls[piece.material]) == nullptr)
+			{
+				printf("Error: loadStaticLevel could not create the shape of piece %u\n", PxU32(i));
+				actor->release();
+				continue;
+			}
+			built.push_back(actor);
+		}
+		levelActors.swap(built);
+		levelBuildTime = chrono::duration<PxReal>(chrono::high_resolution_clock::now() - start).count();
+		levelReady.store(1, std::memory_order_release);
+	};
+
+	{
+		// The previous level goes in first, if the steps haven't merged it yet
+		unique_lock<mutex> lock(engineMutex);
+		if (levelReady.load(std::memory_order_acquire))
+			mergeStaticLevel();
+		levelPending = true;
+		if (background)
+		{
+			levelLoader = new thread(build);
+			return;
+		}
+	}
+
+	// Built without the engine lock too, then merged straight away (unless a step got to it first)
+	build();
+	unique_lock<mutex> lock(engineMutex);
+	if (levelReady.load(std::memory_order_acquire))
+		mergeStaticLevel();
+}
+
+void PhysicsEngine::joinLevelLoader()
+{
+	if (levelLoader == nullptr)
+		return;
+	levelLoader->join();
+	delete levelLoader;
+	levelLoader = nullptr;
+}
+
+void PhysicsEngine::mergeStaticLevel()
+{
+	// The loader has published its actors, so it is about to exit
+	joinLevelLoader();
+	levelReady.store(0, std::memory_order_release);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	levelActorCount = PxU32(levelActors.size());
+	if (!levelActors.empty())
+	{
+		scene->addActors(&levelActors[0], levelActorCount);
+		broadPhaseLayoutPending = true;
+		// Build the static tree now, instead of letting queries run against a tree being rebuilt over the next steps
+		scene->forceDynamicTreeRebuild(true, false);
+	}
+	levelActors.clear();
+	levelPending = false;
+	levelMergeTime = chrono::duration<PxReal>(chrono::high_resolution_clock::now() - start).count();
+}
+
+bool PhysicsEngine::isLevelLoading()
+{
+	unique_lock<mutex> lock(engineMutex);
+	return levelPending;
+}
+
+void PhysicsEngine::setDynamicTreeRebuildRateHint(PxU32 hint)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return;
+	// PhysX needs at least 4 steps
+	scene->setDynamicTreeRebuildRateHint(PxMax(hint, 4u));
+}
+
+QueryStructureStatistics PhysicsEngine::getQueryStructureStatistics()
+{
+	unique_lock<mutex> lock(engineMutex);
+	QueryStructureStatistics stats = QueryStructureStatistics();
+	if (scene == nullptr)
+		return stats;
+	stats.staticStructure = scene->getStaticStructure();
+	stats.dynamicStructure = scene->getDynamicStructure();
+	stats.dynamicTreeRebuildRateHint = scene->getDynamicTreeRebuildRateHint();
+	stats.staticTimestamp = scene->getSceneQueryStaticTimestamp();
+
+	PxU32 count = scene->getNbActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC);
+	queryActors.resize(count);
+	if (count > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_DYNAMIC | PxActorTypeFlag::eRIGID_STATIC, &queryActors[0], count);
+	for (PxU32 i = 0; i < count; i++)
+	{
+		if (queryActors[i]->getType() == PxActorType::eRIGID_STATIC)
+			stats.staticShapes += queryActors[i]->isRigidActor()->getNbShapes();
+		else
+			stats.dynamicShapes += queryActors[i]->isRigidActor()->getNbShapes();
+	}
+
+	stats.levelLoading = levelPending;
+	// The loader writes the build time, so it is only read once the level is merged
+	stats.levelActors = levelActorCount;
+	stats.levelBuildTime = stats.levelLoading ? 0.0f : levelBuildTime;
+	stats.levelMergeTime = levelMergeTime;
+	return stats;
+}
+#pragma endregion
+
+#pragma region Broadphase
+void PhysicsEngine::BroadPhaseBoundsCallback::onObjectOutOfBounds(PxShape &shape, PxActor &actor)
+{
+	// Called once for each shape, so multi-shape actors are only listed once
+	if (find(actors.begin(), actors.end(), &actor) == actors.end())
+		actors.push_back(&actor);
+}
+
+void PhysicsEngine::BroadPhaseBoundsCallback::onObjectOutOfBounds(PxAggregate &aggregate)
+{
+	PxU32 numActors = aggregate.getNbActors();
+	for (PxU32 i = 0; i < numActors; i++)
+	{
+		PxActor *actor = nullptr;
+		aggregate.getActors(&actor, 1, i);
+		if ((actor != nullptr) && find(actors.begin(), actors.end(), actor) == actors.end())
+			actors.push_back(actor);
+	}
+}
+
+PxBounds3 PhysicsEngine::getStaticBounds()
+{
+	PxBounds3 bounds = PxBounds3::empty();
+	PxU32 count = scene->getNbActors(PxActorTypeFlag::eRIGID_STATIC);
+	publishActors.resize(count);
+	if (count > 0)
+		scene->getActors(PxActorTypeFlag::eRIGID_STATIC, &publishActors[0], count);
+	for (PxU32 i = 0; i < count; i++)
+		bounds.include(publishActors[i]->getWorldBounds());
+	return bounds;
+}
+
+PxU32 PhysicsEngine::layoutBroadPhaseRegions(const PxBounds3 &bounds, PxU32 subdivisions)
+{
+	if ((broadPhaseType != PxBroadPhaseType::eMBP) || bounds.isEmpty())
+		return 0;
+	for (size_t i = 0; i < broadPhaseRegions.size(); i++)
+		scene->removeBroadPhaseRegion(broadPhaseRegions[i]);
+	broadPhaseRegions.clear();
+
+	// MBP supports at most 256 regions
+	subdivisions = PxClamp(subdivisions, 1u, 16u);
+	PxBounds3 world = PxBounds3::centerExtents(bounds.getCenter(), bounds.getExtents() + PxVec3(broadPhaseMargin));
+	vector<PxBounds3> regionBounds(subdivisions * subdivisions);
+	PxU32 numRegions = PxBroadPhaseExt::createRegionsFromWorldBounds(&regionBounds[0], world, subdivisions);
+	for (PxU32 i = 0; i < numRegions; i++)
+	{
+		PxBroadPhaseRegion region;
+		region.bounds = regionBounds[i];
+		region.userData = nullptr;
+		// Populating the region adds the objects that are already in the scene to it
+		PxU32 handle = scene->addBroadPhaseRegion(region, true);
+		if (handle != 0xffffffff)
+			broadPhaseRegions.push_back(handle);
+	}
+	return PxU32(broadPhaseRegions.size());
+}
+
+PxU32 PhysicsEngine::setupBroadPhaseRegions(PxU32 subdivisions)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return 0;
+	return layoutBroadPhaseRegions(getStaticBounds(), subdivisions);
+}
+
+PxU32 PhysicsEngine::setupBroadPhaseRegions(const PxBounds3 &bounds, PxU32 subdivisions)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene == nullptr)
+		return 0;
+	return layoutBroadPhaseRegions(bounds, subdivisions);
+}
+
+PxU32 PhysicsEngine::addBroadPhaseRegion(const PxBounds3 &bounds)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((scene == nullptr) || (broadPhaseType != PxBroadPhaseType::eMBP) || bounds.isEmpty())
+		return 0xffffffff;
+	PxBroadPhaseRegion region;
+	region.bounds = bounds;
+	region.userData = nullptr;
+	PxU32 handle = scene->addBroadPhaseRegion(region, true);
+	if (handle != 0xffffffff)
+		broadPhaseRegions.push_back(handle);
+	return handle;
+}
+
+void PhysicsEngine::removeBroadPhaseRegion(PxU32 handle)
+{
+	unique_lock<mutex> lock(engineMutex);
+	vector<PxU32>::iterator it = find(broadPhaseRegions.begin(), broadPhaseRegions.end(), handle);
+	if ((scene == nullptr) || (it == broadPhaseRegions.end()))
+		return;
+	scene->removeBroadPhaseRegion(handle);
+	broadPhaseRegions.erase(it);
+}
+
+void PhysicsEngine::getBroadPhaseRegions(vector<PxBroadPhaseRegionInfo> &regions)
+{
+	unique_lock<mutex> lock(engineMutex);
+	regions.clear();
+	if (scene == nullptr)
+		return;
+	PxU32 count = scene->getNbBroadPhaseRegions();
+	regions.resize(count);
+	if (count > 0)
+		scene->getBroadPhaseRegions(&regions[0], count);
+}
+
+void PhysicsEngine::getOutOfBoundsActors(vector<PxActor*> &actors)
+{
+	unique_lock<mutex> lock(engineMutex);
+	actors = broadPhaseCallback.actors;
+}
+#pragma endregion
+
+#pragma region Simulation Statistics
+void PhysicsEngine::getThreadCpuTimes(vector<double> &times)
+{
+	unique_lock<mutex> lock(engineMutex);
+	times.clear();
+	times.push_back((updateThread != nullptr) ? CpuDispatcher::getCpuTime(*updateThread) : 0.0);
+	PxU32 numWorkers = (dispatcher != nullptr) ? dispatcher->getWorkerCount() : 0;
+	for (PxU32 i = 0; i < numWorkers; i++)
+		times.push_back(dispatcher->getWorkerCpuTime(i));
+}
+
+void PhysicsEngine::recordStatistics(PxReal period, PxReal stepTime)
+{
+	StepStatistics &entry = statistics[statisticsNext];
+	entry.step = stepCount;
+	entry.period = period;
+	entry.stepTime = stepTime;
+	entry.activeDynamicBodies = simulationStats.nbActiveDynamicBodies;
+	entry.activeKinematicBodies = simulationStats.nbActiveKinematicBodies;
+	entry.activeConstraints = simulationStats.nbActiveConstraints;
+	entry.solverPartitions = simulationStats.nbPartitions;
+	entry.broadPhaseAdds = simulationStats.getNbBroadPhaseAdds(PxSimulationStatistics::eRIGID_BODY);
+	entry.broadPhaseRemoves = simulationStats.getNbBroadPhaseRemoves(PxSimulationStatistics::eRIGID_BODY);
+	entry.newPairs = simulationStats.nbNewPairs;
+	entry.lostPairs = simulationStats.nbLostPairs;
+	entry.newTouches = simulationStats.nbNewTouches;
+	entry.lostTouches = simulationStats.nbLostTouches;
+	entry.contactPairs = simulationStats.nbDiscreteContactPairsTotal;
+	entry.contactPairsWithContacts = simulationStats.nbDiscreteContactPairsWithContacts;
+	entry.contactPairsWithCacheHits = simulationStats.nbDiscreteContactPairsWithCacheHits;
+	entry.ccdPairs = 0;
+	for (PxU32 i = 0; i < PxGeometryType::eGEOMETRY_COUNT; i++)
+	{
+		for (PxU32 j = 0; j < PxGeometryType::eGEOMETRY_COUNT; j++)
+		{
+			if (j < i)
+			{
+				entry.pairsByGeometry[i][j] = 0;
+				continue;
+			}
+			entry.pairsByGeometry[i][j] = simulationStats.getRbPairStats(PxSimulationStatistics::eDISCRETE_CONTACT_PAIRS, PxGeometryType::Enum(i), PxGeometryType::Enum(j));
+			entry.ccdPairs += simulationStats.getRbPairStats(PxSimulationStatistics::eCCD_PAIRS, PxGeometryType::Enum(i), PxGeometryType::Enum(j));
+		}
+	}
+
+	statisticsNext = (statisticsNext + 1) % statistics.size();
+	statisticsCount = PxMin(statisticsCount + 1, statistics.size());
+}
+
+void PhysicsEngine::getStatistics(vector<StepStatistics> &history)
+{
+	unique_lock<mutex> lock(engineMutex);
+	history.clear();
+	size_t first = (statisticsNext + statistics.size() - statisticsCount) % PxMax(statistics.size(), size_t(1));
+	for (size_t i = 0; i < statisticsCount; i++)
+		history.push_back(statistics[(first + i) % statistics.size()]);
+}
+
+void PhysicsEngine::sizeScratchBlock()
+{
+	// A rough upper bound on the solver's temporaries for this many bodies, constraints and contacts
+	size_t required = size_t(simulationStats.nbActiveDynamicBodies + simulationStats.nbActiveKinematicBodies) * 256 +
+		size_t(simulationStats.nbActiveConstraints) * 512 + size_t(simulationStats.nbDiscreteContactPairsTotal) * 512;
+	if (required <= scratchBlockSize)
+		return;
+
+	// Doubling keeps the number of regrowths (and allocations) small while the scene fills up
+	size_t size = PxMax(required, size_t(scratchBlockSize) * 2);
+	size = (size + SCRATCH_BLOCK_GRANULARITY - 1) / SCRATCH_BLOCK_GRANULARITY * SCRATCH_BLOCK_GRANULARITY;
+	sdkAllocator.deallocate(scratchBlock);
+	scratchBlockSize = PxU32(size);
+	scratchBlock = sdkAllocator.allocate(scratchBlockSize, "ScratchBlock", __FILE__, __LINE__);
+}
+
+void PhysicsEngine::dumpStatistics(FILE *file)
+{
+	if (file == nullptr)
+		return;
+	// Copied out first, so the file isn't written with the engine locked
+	vector<StepStatistics> history;
+	getStatistics(history);
+
+	static const char *geometryNames[PxGeometryType::eGEOMETRY_COUNT] = { "sphere", "plane", "capsule", "box", "convex", "mesh", "heightfield" };
+	fprintf(file, "step,period,stepTime,activeDynamic,activeKinematic,activeConstraints,solverPartitions,bpAdds,bpRemoves,newPairs,lostPairs,newTouches,lostTouches,contactPairs,pairsWithContacts,pairsWithCacheHits,ccdPairs");
+	for (PxU32 i = 0; i < PxGeometryType::eGEOMETRY_COUNT; i++)
+		for (PxU32 j = i; j < PxGeometryType::eGEOMETRY_COUNT; j++)
+			fprintf(file, ",%s-%s", geometryNames[i], geometryNames[j]);
+	fprintf(file, "\n");
+
+	for (size_t k = 0; k < history.size(); k++)
+	{
+		const StepStatistics &entry = history[k];
+		fprintf(file, "%llu,%g,%g,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u", (unsigned long long)entry.step, entry.period, entry.stepTime,
+			entry.activeDynamicBodies, entry.activeKinematicBodies, entry.activeConstraints, entry.solverPartitions, entry.broadPhaseAdds, entry.broadPhaseRemoves,
+			entry.newPairs, entry.lostPairs, entry.newTouches, entry.lostTouches, entry.contactPairs, entry.contactPairsWithContacts, entry.contactPairsWithCacheHits, entry.ccdPairs);
+		for (PxU32 i = 0; i < PxGeometryType::eGEOMETRY_COUNT; i++)
+			for (PxU32 j = i; j < PxGeometryType::eGEOMETRY_COUNT; j++)
+				fprintf(file, ",%u", entry.pairsByGeometry[i][j]);
+		fprintf(file, "\n");
+	}
+}
+#pragma endregion
+
+#pragma region Simulation Level of Detail
+SimulationLodBand::SimulationLodBand():
+	maxDistance(PX_MAX_F32),
+	positionIterations(0),
+	velocityIterations(0),
+	sleepThreshold(0.0f),
+	sleepOnEntry(false),
+	freeze(false)
+{
+}
+
+void PhysicsEngine::updateLod()
+{
+	lodPopulations.assign(lodBands.size(), 0);
+	for (size_t i = 0; i < dynamicActors.size(); i++)
+	{
+		PxRigidDynamic *actor = (PxRigidDynamic*)dynamicActors[i];
+		unordered_map<PxRigidDynamic*, LodState>::iterator it = lodStates.find(actor);
+		if (it == lodStates.end())
+		{
+			// Kinematic bodies are animated by the user, so only dynamic ones are managed
+			if (actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC)
+				continue;
+			LodState state;
+			state.band = PxU32(-1);		// Not in any band yet, so the first evaluation applies one
+			actor->getSolverIterationCounts(state.positionIterations, state.velocityIterations);
+			state.sleepThreshold = actor->getSleepThreshold();
+			state.frozen = false;
+			it = lodStates.insert(make_pair(actor, state)).first;
+		}
+
+		PxVec3 position = actor->getGlobalPose().p;
+		PxReal distanceSq = PX_MAX_F32;
+		for (size_t j = 0; j < lodFocusPoints.size(); j++)
+			distanceSq = PxMin(distanceSq, (position - lodFocusPoints[j]).magnitudeSquared());
+
+		PxU32 band = 0;
+		while ((band + 1 < lodBands.size()) && (distanceSq > lodBands[band].maxDistance * lodBands[band].maxDistance))
+			band++;
+
+		// Only transitions touch the body, so bodies that stay in their band cost one distance test
+		if (band != it->second.band)
+			applyLodBand(actor, it->second, band);
+		lodPopulations[band]++;
+	}
+}
+
+void PhysicsEngine::applyLodBand(PxRigidDynamic *actor, LodState &state, PxU32 band)
+{
+	const SimulationLodBand &settings = lodBands[band];
+	actor->setSolverIterationCounts((settings.positionIterations > 0) ? settings.positionIterations : state.positionIterations, (settings.velocityIterations > 0) ? settings.velocityIterations : state.velocityIterations);
+	actor->setSleepThreshold((settings.sleepThreshold > 0.0f) ? settings.sleepThreshold : state.sleepThreshold);
+
+	if (settings.freeze && !state.frozen)
+	{
+		state.linearVelocity = actor->getLinearVelocity();
+		state.angularVelocity = actor->getAngularVelocity();
+		actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, true);
+		state.frozen = true;
+	}
+	else if (!settings.freeze && state.frozen)
+	{
+		actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, false);
+		actor->setLinearVelocity(state.linearVelocity);
+		actor->setAngularVelocity(state.angularVelocity);
+		state.frozen = false;
+	}
+
+	if (settings.sleepOnEntry && !state.frozen)
+		actor->putToSleep();
+	else if ((band < state.band) && !state.frozen)
+		actor->wakeUp();
+	state.band = band;
+}
+
+void PhysicsEngine::restoreLod()
+{
+	for (unordered_map<PxRigidDynamic*, LodState>::iterator it = lodStates.begin(); it != lodStates.end(); ++it)
+	{
+		PxRigidDynamic *actor = it->first;
+		LodState &state = it->second;
+		actor->setSolverIterationCounts(state.positionIterations, state.velocityIterations);
+		actor->setSleepThreshold(state.sleepThreshold);
+		if (state.frozen)
+		{
+			actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, false);
+			actor->setLinearVelocity(state.linearVelocity);
+			actor->setAngularVelocity(state.angularVelocity);
+		}
+		actor->wakeUp();
+	}
+	lodStates.clear();
+}
+
+void PhysicsEngine::restoreLodStates(const unordered_map<PxRigidDynamic*, LodState> &states)
+{
+	// Bodies banded now but not in the saved states go back to full detail
+	for (unordered_map<PxRigidDynamic*, LodState>::iterator it = lodStates.begin(); it != lodStates.end(); ++it)
+	{
+		PxRigidDynamic *actor = it->first;
+		if ((liveBodies.find(actor) == liveBodies.end()) || (states.find(actor) != states.end()))
+			continue;
+		actor->setSolverIterationCounts(it->second.positionIterations, it->second.velocityIterations);
+		actor->setSleepThreshold(it->second.sleepThreshold);
+		if (it->second.frozen)
+			actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, false);
+	}
+
+	// The rest get their saved band's settings and frozen state back
+	for (unordered_map<PxRigidDynamic*, LodState>::const_iterator it = states.begin(); it != states.end(); ++it)
+	{
+		PxRigidDynamic *actor = it->first;
+		if (liveBodies.find(actor) == liveBodies.end())
+			continue;
+		const LodState &state = it->second;
+		unordered_map<PxRigidDynamic*, LodState>::iterator current = lodStates.find(actor);
+		bool frozen = (current != lodStates.end()) && current->second.frozen;
+		if (state.frozen != frozen)
+			actor->setRigidBodyFlag(PxRigidBodyFlag::eKINEMATIC, state.frozen);
+		if (state.band < lodBands.size())
+		{
+			const SimulationLodBand &settings = lodBands[state.band];
+			actor->setSolverIterationCounts((settings.positionIterations > 0) ? settings.positionIterations : state.positionIterations, (settings.velocityIterations > 0) ? settings.velocityIterations : state.velocityIterations);
+			actor->setSleepThreshold((settings.sleepThreshold > 0.0f) ? settings.sleepThreshold : state.sleepThreshold);
+		}
+		else
+		{
+			actor->setSolverIterationCounts(state.positionIterations, state.velocityIterations);
+			actor->setSleepThreshold(state.sleepThreshold);
+		}
+	}
+
+	lodStates = states;
+	for (unordered_map<PxRigidDynamic*, LodState>::iterator it = lodStates.begin(); it != lodStates.end();)
+	{
+		if (liveBodies.find(it->first) == liveBodies.end())
+			it = lodStates.erase(it);
+		else
+			++it;
+	}
+}
+
+void PhysicsEngine::setLodBands(const SimulationLodBand *bands, PxU32 numBands, PxU32 interval)
+{
+	unique_lock<mutex> lock(engineMutex);
+	// Bodies are put back to full detail, and re-banded against the new bands at the next evaluation
+	restoreLod();
+	lodBands.assign(bands, bands + ((bands != nullptr) ? numBands : 0));
+	sort(lodBands.begin(), lodBands.end(), [](const SimulationLodBand &a, const SimulationLodBand &b)
+	{
+		return a.maxDistance < b.maxDistance;
+	});
+	lodInterval = PxMax(interval, 1u);
+	lodPopulations.assign(lodBands.size(), 0);
+}
+
+void PhysicsEngine::setLodFocusPoints(const PxVec3 *points, PxU32 numPoints)
+{
+	unique_lock<mutex> lock(engineMutex);
+	lodFocusPoints.assign(points, points + ((points != nullptr) ? numPoints : 0));
+}
+
+void PhysicsEngine::getLodPopulations(vector<PxU32> &populations)
+{
+	unique_lock<mutex> lock(engineMutex);
+	populations = lodPopulations;
+}
+#pragma endregion
+
+#pragma region Continuous Collision Detection
+PxFilterFlags PhysicsEngine::ccdFilterShader(PxFilterObjectAttributes attributes0, PxFilterData filterData0, PxFilterObjectAttributes attributes1, PxFilterData filterData1, PxPairFlags &pairFlags, const void *constantBlock, PxU32 constantBlockSize)
+{
+	// The user's constant block follows the wrapped shader, and is passed on to it
+	PxSimulationFilterShader shader = PxDefaultSimulationFilterShader;
+	const void *userBlock = nullptr;
+	PxU32 userBlockSize = 0;
+	if ((constantBlock != nullptr) && (constantBlockSize >= CCD_SHADER_BLOCK_HEADER))
+	{
+		memcpy(&shader, constantBlock, sizeof(PxSimulationFilterShader));
+		userBlockSize = constantBlockSize - CCD_SHADER_BLOCK_HEADER;
+		if (userBlockSize > 0)
+			userBlock = (const uint8_t*)constantBlock + CCD_SHADER_BLOCK_HEADER;
+	}
+	PxFilterFlags flags = shader(attributes0, filterData0, attributes1, filterData1, pairFlags, userBlock, userBlockSize);
+
+	// CCD only runs for pairs that ask for it, and only for bodies with PxRigidBodyFlag::eENABLE_CCD set. Pairs the wrapped
+	// shader suppressed or killed are left alone
+	if (flags & (PxFilterFlag::eSUPPRESS | PxFilterFlag::eKILL))
+		return flags;
+	if (!PxFilterObjectIsTrigger(attributes0) && !PxFilterObjectIsTrigger(attributes1))
+		pairFlags |= PxPairFlag::eCCD_LINEAR;
+	return flags;
+}
+
+void PhysicsEngine::updateAutomaticCCD()
+{
+	// Bodies switch CCD on above the threshold and back off below half of it, so they don't toggle every step
+	PxU32 count = PxU32(dynamicActors.size());
+	PxReal enableSq = ccdVelocityThreshold * ccdVelocityThreshold;
+	PxReal disableSq = 0.25f * enableSq;
+	for (PxU32 i = 0; i < count; i++)
+	{
+		PxRigidDynamic *actor = (PxRigidDynamic*)dynamicActors[i];
+		PxRigidBodyFlags flags = actor->getRigidBodyFlags();
+		if (flags & PxRigidBodyFlag::eKINEMATIC)
+			continue;
+		PxReal speedSq = actor->getLinearVelocity().magnitudeSquared();
+		bool enabled = flags & PxRigidBodyFlag::eENABLE_CCD;
+		if (!enabled && speedSq > enableSq)
+			actor->setRigidBodyFlag(PxRigidBodyFlag::eENABLE_CCD, true);
+		else if (enabled && speedSq < disableSq && find(ccdActors.begin(), ccdActors.end(), actor) == ccdActors.end())
+			actor->setRigidBodyFlag(PxRigidBodyFlag::eENABLE_CCD, false);
+	}
+}
+
+void PhysicsEngine::setCCD(PxRigidDynamic *actor, bool enabled)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (actor == nullptr)
+		return;
+	vector<PxRigidDynamic*>::iterator it = find(ccdActors.begin(), ccdActors.end(), actor);
+	if (enabled && it == ccdActors.end())
+		ccdActors.push_back(actor);
+	else if (!enabled && it != ccdActors.end())
+		ccdActors.erase(it);
+	actor->setRigidBodyFlag(PxRigidBodyFlag::eENABLE_CCD, enabled);
+}
+
+void PhysicsEngine::setContactOffsets(PxRigidActor *actor, PxReal contactOffset, PxReal restOffset)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((actor == nullptr) || (contactOffset <= restOffset))
+		return;
+	PxU32 numShapes = actor->getNbShapes();
+	vector<PxShape*> shapes(numShapes);
+	if (numShapes > 0)
+		actor->getShapes(&shapes[0], numShapes, 0);
+	for (PxU32 i = 0; i < numShapes; i++)
+	{
+		shapes[i]->setContactOffset(contactOffset);
+		shapes[i]->setRestOffset(restOffset);
+	}
+}
+#pragma endregion
+
+void PhysicsEngine::setMaterialProperties(Material mat, PxReal staticFriction, PxReal dynamicFriction, PxReal restitution)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if ((scene == nullptr) || (mat < Wood) || (mat > Concrete))
+		return;
+	mtls[mat]->setStaticFriction(staticFriction);
+	mtls[mat]->setDynamicFriction(dynamicFriction);
+	mtls[mat]->setRestitution(restitution);
+}
+
+void PhysicsEngine::setGravity(vec3 gravity)
+{
+	unique_lock<mutex> lock(engineMutex);
+	if (scene != nullptr)
+	{
+		scene->setGravity(gravity);
+	}
+}
+
+#pragma region Common Inertia Tensors
+vec3 PhysicsEngine::InertiaTensorSolidSphere(PxReal radius, PxReal mass)
+{
+	return vec3((mass*radius*radius)*0.4f);
+}
+
+vec3 PhysicsEngine::InertiaTensorHollowSphere(PxReal radius, PxReal mass)
+{
+	return vec3((mass*radius*radius)*(0.2f/0.3f));
+}
+
+vec3 PhysicsEngine::InertiaTensorSolidCube(PxReal width, PxReal mass)
+{
+	return vec3((mass*width*width)/6.0f);
+}
+
+vec3 PhysicsEngine::InertiaTensorSolidCapsule(PxReal radius, PxReal halfHeight, PxReal mass)
+{
 	// TODO: Replace with correct values
 	
 	PxReal capmass = mass*(((4.0f / 3.0f)*radius) / (2.0f*halfHeight + (4.0f / 3.0f)*radius));
@@ -405,26 +2561,128 @@ PhysicsEngine::~PhysicsEngine()
 		updateThread->join();
 	}
 
-	if (physics != nullptr)
+	if (debrisQuery != nullptr)
+	{
+		debrisQuery->release();
+	}
+
+	// A level still being built is finished and thrown away
+	joinLevelLoader();
+	for (size_t i = 0; i < levelActors.size(); i++)
+		levelActors[i]->release();
+	levelActors.clear();
+
+	// Character controllers own kinematic actors in the scene, so they go first
+	if (controllerManager != nullptr)
+	{
+		controllerManager->release();
+	}
+
+	if (scene != nullptr)
 	{
-		physics->release();
+		// Releasing the scene only removes what is in it, and the SDK outlives this engine, so everything the scene holds is
+		// released first: joints, then articulations (with their links), then actors (with their shapes), then the emptied aggregates
+		PxU32 numConstraints = scene->getNbConstraints();
+		vector<PxConstraint*> constraints(numConstraints);
+		if (numConstraints > 0)
+			scene->getConstraints(&constraints[0], numConstraints);
+		for (PxU32 i = 0; i < numConstraints; i++)
+		{
+			PxU32 typeId = 0;
+			void *external = constraints[i]->getExternalReference(typeId);
+			if ((external != nullptr) && (typeId == PxConstraintExtIDs::eJOINT))
+				((PxJoint*)external)->release();
+		}
+
+		PxU32 numArticulations = scene->getNbArticulations();
+		publishArticulations.resize(numArticulations);
+		if (numArticulations > 0)
+			scene->getArticulations(&publishArticulations[0], numArticulations);
+		for (PxU32 i = 0; i < numArticulations; i++)
+			publishArticulations[i]->release();
+
+		PxU32 numActors = scene->getNbActors(PxActorTypeFlag::eRIGID_STATIC | PxActorTypeFlag::eRIGID_DYNAMIC);
+		queryActors.resize(numActors);
+		if (numActors > 0)
+			scene->getActors(PxActorTypeFlag::eRIGID_STATIC | PxActorTypeFlag::eRIGID_DYNAMIC, &queryActors[0], numActors);
+		for (PxU32 i = 0; i < numActors; i++)
+			queryActors[i]->release();
+
+		PxU32 numAggregates = scene->getNbAggregates();
+		vector<PxAggregate*> aggregates(numAggregates);
+		if (numAggregates > 0)
+			scene->getAggregates(&aggregates[0], numAggregates);
+		for (PxU32 i = 0; i < numAggregates; i++)
+			aggregates[i]->release();
+
+		scene->release();
+		for (int i = 0; i < 6; i++)
+			mtls[i]->release();
 	}
 
-	if (cooking != nullptr)
+	if (scratchBlock != nullptr)
 	{
-		cooking->release();
+		sdkAllocator.deallocate(scratchBlock);
 	}
 
-	if (foundation != nullptr)
+	// The scene is gone, so nothing can submit tasks any more
+	delete dispatcher;
+
+	// Meshes and other shared objects live until the last engine is destroyed
+	if (physics != nullptr)
 	{
-		foundation->release();
+		releaseSDK();
 	}
 }
 
-void PhysicsEngine::PxRigidAerodynamic::ApplyLiftAndDrag()
+void PhysicsEngine::PxRigidAerodynamic::ApplyLiftAndDrag(const PxVec3 &airVelocity, PxReal airDensity)
 {
-	if (!actor)
+	if (!actor || actor->isSleeping() || (actor->getRigidBodyFlags() & PxRigidBodyFlag::eKINEMATIC))
+		return;
+
+	// Forces come from the body's motion through the air, not over the ground
+	PxVec3 velocity = actor->getLinearVelocity() - airVelocity;
+	PxReal speedSq = velocity.magnitudeSquared();
+	if (speedSq < 1e-6f)
 		return;
-	// TODO: Correct calculation of lift and drag (and drag-from-lift) forces
+	PxReal speed = PxSqrt(speedSq);
+	PxReal dynamicPressure = 0.5f * airDensity * speedSq * SurfaceArea;
+
+	// Drag opposes the relative velocity
+	PxVec3 force = velocity * (-DragCoefficient * dynamicPressure / speed);
+
+	// Lift is perpendicular to the relative velocity, in the direction the body's spin throws the air (Magnus effect)
+	PxVec3 spin = actor->getAngularVelocity();
+	PxVec3 liftDirection = spin.cross(velocity);
+	PxReal liftMagnitude = liftDirection.magnitude();
+	if (liftMagnitude > 1e-6f)
+		force += liftDirection * (LiftCoefficient * dynamicPressure / liftMagnitude);
+
+	actor->addForce(force, PxForceMode::eFORCE, false);
+}
+
+#pragma region Snapshots
+PhysicsSnapshot::PhysicsSnapshot():
+	step(0),
+	period(0.0f)
+{
+}
+
+PxReal PhysicsSnapshot::getAlpha(chrono::high_resolution_clock::time_point now) const
+{
+	if (period <= 0.0f)
+		return 1.0f;
+	PxReal alpha = chrono::duration<PxReal>(now - time).count() / period;
+	return PxClamp(alpha, 0.0f, 1.0f);
+}
 
-}
\ No newline at end of file
+PxTransform PhysicsSnapshot::interpolate(const Shape &shape, PxReal alpha)
+{
+	// Normalized lerp along the shortest arc is close enough to a slerp over a single step
+	PxQuat q1 = shape.pose.q;
+	if (shape.previousPose.q.dot(q1) < 0.0f)
+		q1 = -q1;
+	PxQuat q = shape.previousPose.q * (1.0f - alpha) + q1 * alpha;
+	return PxTransform(shape.previousPose.p + (shape.pose.p - shape.previousPose.p) * alpha, q.getNormalized());
+}
+#pragma endregion
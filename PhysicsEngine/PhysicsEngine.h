@@ -2,6 +2,8 @@
 #define _PHYS_ENG_H_
 
 #include "types.h"
+#include "CpuDispatcher.h"
+#include "MeshImporter.h"
 
 #include <cstdio>
 #include <vector>
@@ -9,20 +11,309 @@
 #include <mutex>
 #include <PxPhysicsAPI.h>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifdef _WIN32
 #pragma comment(lib, "x86\\PhysX3_x86.lib")
 #pragma comment(lib, "x86\\PhysX3Common_x86.lib")
 #pragma comment(lib, "x86\\PhysX3Extensions.lib")
 #pragma comment(lib, "x86\\PhysX3Cooking_x86.lib")
+#pragma comment(lib, "x86\\PhysX3CharacterKinematic_x86.lib")
 #endif
 
+// Options used to configure the engine when it is constructed
+struct PhysicsEngineDesc
+{
+	uint32_t frequency;								// DEFAULT: 360 Hz
+
+	// Continuous collision detection
+	bool enableCCD;									// DEFAULT: false (sets PxSceneFlag::eENABLE_CCD and requests CCD for every contact pair)
+	physx::PxU32 ccdMaxPasses;						// DEFAULT: 1
+	physx::PxReal ccdVelocityThreshold;				// DEFAULT: 0 (off). Dynamic bodies faster than this (m/s) get CCD enabled automatically
+
+	// Adaptive step rate. When enabled, the engine picks its frequency before every step, within the bounds below
+	bool enableGovernor;							// DEFAULT: false
+	uint32_t governorMinFrequency;					// DEFAULT: 60 Hz
+	uint32_t governorMaxFrequency;					// DEFAULT: 360 Hz
+	physx::PxReal governorMaxTravel;				// DEFAULT: 0.25. The fraction of its own size a body may move in one step
+	physx::PxReal governorContactSpike;				// DEFAULT: 2. Contact pairs above this multiple of the running average count as a spike
+	physx::PxReal governorBudget;					// DEFAULT: 0.5. The fraction of the period a step may take before the rate is lowered
+
+	// Broadphase. With eMBP, a grid of regions is laid out over the static actors before the first step (objects outside every region don't collide)
+	physx::PxBroadPhaseType::Enum broadPhaseType;	// DEFAULT: eSAP
+	physx::PxU32 broadPhaseSubdivisions;			// DEFAULT: 4. The automatic grid has this many regions along each horizontal axis (at most 16)
+	physx::PxReal broadPhaseMargin;					// DEFAULT: 10. Distance the automatic grid extends beyond the static actors on every side
+
+	// Force fields
+	physx::PxReal airDensity;						// DEFAULT: 1.225 kg/m^3. Used for aerodynamic lift and drag, and for drag from wind fields
+	physx::PxReal forceFieldCellSize;				// DEFAULT: 10. Size of the cells force fields are indexed in
+
+	// Debris: small spheres simulated outside PhysX, colliding only with static actors. The oldest are removed to stay in budget
+	physx::PxU32 debrisBudget;						// DEFAULT: 16384 (0 turns debris off)
+	physx::PxReal debrisLifetime;					// DEFAULT: 10 s (0 keeps debris until it is evicted)
+	physx::PxReal debrisRestitution;				// DEFAULT: 0.3
+	physx::PxReal debrisFriction;					// DEFAULT: 0.4. The fraction of sliding speed lost at each bounce
+
+	// Scene query structures. A static AABB tree is rebuilt whole when statics change, which suits levels loaded in bulk
+	physx::PxPruningStructure::Enum staticStructure;	// DEFAULT: eDYNAMIC_AABB_TREE
+	physx::PxU32 dynamicTreeRebuildRateHint;		// DEFAULT: 100. Steps over which the dynamic tree is rebuilt in the background
+
+	// Checkpoints of the dynamic state kept for restore
+	physx::PxU32 checkpointHistory;					// DEFAULT: 8
+
+	// Threads. PhysX runs its tasks on the workers; the update thread paces the steps
+	bool startUpdateThread;							// DEFAULT: true. Without it, the engine only steps when step() is called
+	physx::PxU32 workerThreads;						// DEFAULT: 1 (0 runs PhysX's tasks on the thread that steps the scene)
+	std::vector<ThreadSchedule> workerSchedules;	// DEFAULT: none. Worker i uses entry i if there is one (pinning, SCHED_FIFO or nice)
+	ThreadSchedule updateThreadSchedule;			// DEFAULT: any core, normal priority
+
+	// Scratch memory handed to PhysX for each step, so its per-step temporaries don't go through the allocator
+	physx::PxU32 scratchBlockSize;					// DEFAULT: 64 KB (0 turns it off). Rounded up to 16 KB, and grown with the scene
+
+	// Simulation statistics are recorded after every step into a history of this many steps (0 turns recording off)
+	physx::PxU32 statisticsHistory;					// DEFAULT: 600
+
+	// A snapshot of every shape's pose is published after each step for acquireSnapshot. Headless engines can turn it off
+	bool publishSnapshots;							// DEFAULT: true
+
+	// Collision filtering. When CCD is enabled, the engine wraps this shader and adds CCD to the pairs it keeps
+	physx::PxSimulationFilterShader filterShader;	// DEFAULT: PxDefaultSimulationFilterShader
+	const void *filterShaderData;					// DEFAULT: nullptr. The shader's constant block (PhysX copies it)
+	physx::PxU32 filterShaderDataSize;				// DEFAULT: 0
+
+	PhysicsEngineDesc();
+};
+
+// Options used when cooking a convex mesh
+struct ConvexCookingOptions
+{
+	physx::PxU32 vertexLimit;				// DEFAULT: 256. The maximum number of hull vertices (4 to 256)
+	physx::PxU32 polygonLimit;				// DEFAULT: 0 (none). Hulls with more faces are recooked with fewer vertices until they fit
+	bool inflate;							// DEFAULT: false. Pushes the hull planes out by skinWidth (PxConvexFlag::eINFLATE_CONVEX)
+	physx::PxReal skinWidth;				// DEFAULT: 0.025
+	physx::PxReal quantization;				// DEFAULT: 0 (off). Merges the input points that fall in the same cell of a grid this size
+
+	ConvexCookingOptions();
+};
+
+// Hulls cooked from the same point cloud at decreasing levels of detail (level 0 is the most detailed)
+struct ConvexHullSet
+{
+	std::vector<physx::PxConvexMesh*> levels;
+};
+
+// Options used when cooking a triangle mesh
+struct TriangleMeshCookingOptions
+{
+	bool cleanMesh;									// DEFAULT: true. Removes duplicate and degenerate triangles (turn off only for meshes that are already clean)
+	physx::PxReal weldTolerance;					// DEFAULT: 0 (off). Welds vertices closer together than this (requires cleanMesh)
+	bool precomputeActiveEdges;						// DEFAULT: true. Turning this off cooks faster but makes contact generation slower
+	physx::PxMeshCookingHint::Enum cookingHint;		// DEFAULT: eSIM_PERFORMANCE. eCOOKING_PERFORMANCE builds the midphase faster but queries it more slowly
+	physx::PxReal sizePerformanceTradeOff;			// DEFAULT: 0.55. Midphase structure, from 0 (smallest) to 1 (fastest queries)
+
+	TriangleMeshCookingOptions();
+};
+
+// Measurements taken while cooking a triangle mesh
+struct TriangleMeshCookReport
+{
+	bool success;
+	physx::PxU32 inputVertices;
+	physx::PxU32 inputTriangles;
+	physx::PxU32 vertices;							// After cleaning and welding
+	physx::PxU32 triangles;							// After cleaning
+	bool indices16Bit;								// Whether the cooked mesh stores 16 bit indices
+	physx::PxReal cookTime;							// Seconds
+	physx::PxU32 cookedSize;						// Bytes of cooked data (close to the mesh's memory footprint)
+};
+
+// A step rate chosen by the governor, and the measurements that led to it
+struct GovernorDecision
+{
+	enum Reason
+	{
+		Steady,			// Nothing required a change
+		Speed,			// A body is moving too far relative to its size in each step
+		ContactSpike,	// The number of contact pairs jumped above its running average
+		OverBudget,		// Steps are taking too much of their period
+		Calm			// The scene no longer needs the current rate
+	};
+
+	uint64_t step;						// The step after which the decision was made
+	uint32_t previousFrequency;			// Hz
+	uint32_t frequency;					// Hz, used from the next step on
+	Reason reason;
+	physx::PxReal maxSpeedRatio;		// The highest body speed divided by that body's size (1/s)
+	physx::PxU32 contactPairs;			// Contact pairs touching during the step
+	physx::PxReal stepTime;				// Wall-clock time taken by simulate and fetchResults (s)
+};
+
+// The state of the scene query structures, and of the last static level loaded in bulk
+struct QueryStructureStatistics
+{
+	physx::PxPruningStructure::Enum staticStructure;
+	physx::PxPruningStructure::Enum dynamicStructure;
+	physx::PxU32 dynamicTreeRebuildRateHint;
+	physx::PxU32 staticShapes;
+	physx::PxU32 dynamicShapes;				// Shapes of rigid dynamic actors (articulation links aren't counted)
+	physx::PxU32 staticTimestamp;			// Changes whenever the static structure does
+	bool levelLoading;						// A level is being built, or is waiting for the next step to be merged
+	physx::PxU32 levelActors;				// Actors in the last level merged
+	physx::PxReal levelBuildTime;			// Seconds the last level took to build, off the update thread if it was loaded in the background
+	physx::PxReal levelMergeTime;			// Seconds adding it to the scene and building its query tree took
+};
+
+// What the broadphase, narrowphase and solver did during one step
+struct StepStatistics
+{
+	uint64_t step;
+	physx::PxReal period;							// Simulated time (s)
+	physx::PxReal stepTime;							// Wall-clock time taken by simulate and fetchResults (s)
+	physx::PxU32 activeDynamicBodies;
+	physx::PxU32 activeKinematicBodies;
+	physx::PxU32 activeConstraints;
+	physx::PxU32 solverPartitions;					// Independent constraint groups the solver worked on
+	physx::PxU32 broadPhaseAdds;					// Rigid body volumes added to the broadphase
+	physx::PxU32 broadPhaseRemoves;
+	physx::PxU32 newPairs;							// Broadphase pairs found and lost during the step
+	physx::PxU32 lostPairs;
+	physx::PxU32 newTouches;						// Shape pairs that started and stopped touching
+	physx::PxU32 lostTouches;
+	physx::PxU32 contactPairs;						// Narrowphase pairs tested
+	physx::PxU32 contactPairsWithContacts;			// Narrowphase pairs that produced contacts
+	physx::PxU32 contactPairsWithCacheHits;			// Narrowphase pairs that reused last step's result
+	physx::PxU32 ccdPairs;
+	physx::PxU32 pairsByGeometry[physx::PxGeometryType::eGEOMETRY_COUNT][physx::PxGeometryType::eGEOMETRY_COUNT];	// Narrowphase pairs, indexed by the smaller geometry type first
+};
+
+// A distance band of the simulation level of detail system. Bands are ordered by distance from the nearest focus point
+struct SimulationLodBand
+{
+	physx::PxReal maxDistance;				// Bodies up to this far from the nearest focus point (and beyond the previous band) are in this band
+	physx::PxU32 positionIterations;		// Solver position iterations (0 keeps the body's own)
+	physx::PxU32 velocityIterations;		// Solver velocity iterations (0 keeps the body's own)
+	physx::PxReal sleepThreshold;			// Mass-normalized kinetic energy below which bodies may sleep (0 keeps the body's own)
+	bool sleepOnEntry;						// Puts bodies to sleep as soon as they enter the band
+	bool freeze;							// Makes bodies kinematic (holding their velocities) until they are promoted out of the band
+
+	SimulationLodBand();
+};
+
+// A volume that pushes on the bodies inside it. Wind and vortex fields move the air, so aerodynamic actors feel them through
+// their lift and drag, and other bodies only if drag is set
+struct ForceField
+{
+	enum Type
+	{
+		Wind,			// Air moving at velocity
+		Vortex,			// Air turning about axis (through center) at strength m/s, fading to nothing at radius
+		Explosion,		// An impulse of strength N s away from center, fading to nothing at radius. Applied once, then removed
+		Buoyancy		// Fluid of density strength kg/m^3 below the plane through center with normal axis (damping in drag, per second)
+	};
+
+	Type type;
+	physx::PxBounds3 bounds;		// The volume the field acts in
+	physx::PxVec3 velocity;
+	physx::PxVec3 center;
+	physx::PxVec3 axis;
+	physx::PxReal strength;
+	physx::PxReal radius;
+	physx::PxReal drag;				// Drag coefficient for bodies that aren't aerodynamic (0 leaves them alone)
+
+	ForceField();
+
+	// Returns the velocity of the air this field moves at a point inside it (zero for fields that don't move air)
+	physx::PxVec3 getAirVelocity(const physx::PxVec3 &point) const;
+
+	static ForceField wind(const physx::PxBounds3 &bounds, physx::PxVec3 velocity, physx::PxReal drag = 0.0f);
+	static ForceField vortex(physx::PxVec3 center, physx::PxVec3 axis, physx::PxReal speed, physx::PxReal radius, physx::PxReal height, physx::PxReal drag = 0.0f);
+	static ForceField explosion(physx::PxVec3 center, physx::PxReal impulse, physx::PxReal radius);
+	static ForceField buoyancy(const physx::PxBounds3 &bounds, physx::PxVec3 surfacePoint, physx::PxVec3 surfaceNormal, physx::PxReal density, physx::PxReal damping = 1.0f);
+};
+
+// A pose a kinematic actor passes through at a given time (seconds from the start of its motion)
+struct KinematicKeyframe
+{
+	physx::PxReal time;
+	physx::PxTransform pose;
+};
+
+// How a kinematic actor moves. The engine evaluates it at the end of every step and moves the actor there with a kinematic target
+struct KinematicMotion
+{
+	enum Type
+	{
+		Keyframes,		// Interpolates between world poses
+		Spinner,		// Turns about the actor's own position at a constant rate
+		Trajectory		// Asks a user function for the world pose
+	};
+
+	Type type;
+	std::vector<KinematicKeyframe> keyframes;						// Sorted by time
+	bool loop;														// Keyframes start over after the last one (otherwise the actor stops there)
+	physx::PxVec3 angularVelocity;									// Spinner rate (rad/s, world axes)
+	std::function<physx::PxTransform(physx::PxReal)> trajectory;	// Called on the update thread with the engine locked, so it must not call back into the engine
+
+	KinematicMotion();
+
+	static KinematicMotion keyframed(const KinematicKeyframe *frames, physx::PxU32 numFrames, bool loop = true);
+	static KinematicMotion spinner(physx::PxVec3 angularVelocity);
+	static KinematicMotion path(std::function<physx::PxTransform(physx::PxReal)> trajectory);
+};
+
+// A copy of the world pose of every shape in the scene, published by the engine at the end of each step
+struct PhysicsSnapshot
+{
+	struct Shape
+	{
+		physx::PxRigidActor *actor;
+		physx::PxGeometryHolder geometry;
+		physx::PxTransform previousPose;		// World pose at the end of the previous step
+		physx::PxTransform pose;				// World pose at the end of this step
+	};
+
+	struct Actor
+	{
+		physx::PxRigidActor *actor;
+		physx::PxBounds3 bounds;				// World bounds at the end of this step
+		uint32_t firstShape;					// Index of the actor's first shape in shapes
+		uint32_t numShapes;
+	};
+
+	struct Debris
+	{
+		physx::PxVec3 previousPosition;
+		physx::PxVec3 position;
+		physx::PxReal radius;
+	};
+
+	std::vector<Actor> actors;
+	std::vector<Shape> shapes;
+	std::vector<Debris> debris;
+	uint64_t step;											// The number of steps simulated before this snapshot was taken
+	physx::PxReal period;									// The simulated time between previousPose and pose
+	std::chrono::high_resolution_clock::time_point time;	// The time at which the snapshot was published
+
+	PhysicsSnapshot();
+
+	// Returns how far (0 to 1) the given time is between this step and the next one
+	physx::PxReal getAlpha(std::chrono::high_resolution_clock::time_point now) const;
+
+	// Returns the pose of a shape interpolated between its previous and current poses
+	static physx::PxTransform interpolate(const Shape &shape, physx::PxReal alpha);
+};
+
 class PhysicsEngine
 {
 private:
 	// Multithreading support
 	std::mutex engineMutex;
 	std::thread *updateThread;
+	ThreadSchedule updateThreadSchedule;
+	CpuDispatcher *dispatcher;
 
 	struct PxRigidAerodynamic
 	{
@@ -30,9 +321,30 @@ private:
 		physx::PxReal LiftCoefficient;
 		physx::PxReal DragCoefficient;
 		physx::PxReal SurfaceArea;
-		void ApplyLiftAndDrag();
+		void ApplyLiftAndDrag(const physx::PxVec3 &airVelocity, physx::PxReal airDensity);
 	};
 
+	// The PhysX SDK, shared by every engine in the process and released with the last one
+	// Guards the SDK's lifetime and the shared cooking parameters (held while cooking). Creating and releasing scenes, materials,
+	// actors and shapes needs no lock: PxPhysics guards its own object pools, so engines can be built on several threads at once
+	static std::mutex sdkMutex;
+	static physx::PxFoundation *sharedFoundation;
+	static physx::PxPhysics *sharedPhysics;
+	static physx::PxCooking *sharedCooking;
+	static uint32_t sdkReferences;
+	static bool acquireSDK(const physx::PxTolerancesScale &scale);
+	static void releaseSDK();
+
+	// Counts every allocation PhysX makes, so allocator traffic in the steady state shows up
+	struct CountingAllocator : public physx::PxAllocatorCallback
+	{
+		physx::PxDefaultAllocator allocator;
+		std::atomic<uint64_t> allocations;
+		virtual void *allocate(size_t size, const char *typeName, const char *filename, int line);
+		virtual void deallocate(void *ptr);
+	};
+	static CountingAllocator sdkAllocator;
+
 	// PhysX classes necessary for interacting with the engine
 	physx::PxPhysics* physics;
 	physx::PxCooking *cooking;
@@ -52,8 +364,196 @@ private:
 	// A list to keep track of all aerodynamic actors
 	std::vector<PxRigidAerodynamic> aeroActors;
 
+	// The dynamic actors in the scene, gathered once after each step for the per-step passes below
+	std::vector<physx::PxActor*> dynamicActors;
+
+	// Continuous collision detection
+	physx::PxReal ccdVelocityThreshold;
+	std::vector<physx::PxRigidDynamic*> ccdActors;		// Actors the user asked to always have CCD
+	static physx::PxFilterFlags ccdFilterShader(physx::PxFilterObjectAttributes attributes0, physx::PxFilterData filterData0, physx::PxFilterObjectAttributes attributes1, physx::PxFilterData filterData1, physx::PxPairFlags &pairFlags, const void *constantBlock, physx::PxU32 constantBlockSize);
+	void updateAutomaticCCD();
+
+	void addToScene(physx::PxActor &actor, physx::PxAggregate *aggregate);
+
+	// Adaptive step rate
+	bool governorEnabled;
+	uint32_t governorMinFrequency;
+	uint32_t governorMaxFrequency;
+	physx::PxReal governorMaxTravel;
+	physx::PxReal governorContactSpike;
+	physx::PxReal governorBudget;
+	physx::PxReal governorContactAverage;
+	GovernorDecision lastDecision;
+	std::function<void(const GovernorDecision&)> governorCallback;
+	void updateGovernor(physx::PxReal stepTime);
+
+	// Broadphase
+	struct BroadPhaseBoundsCallback : public physx::PxBroadPhaseCallback
+	{
+		std::vector<physx::PxActor*> actors;				// Actors that left the region grid during the last step
+		virtual void onObjectOutOfBounds(physx::PxShape &shape, physx::PxActor &actor);
+		virtual void onObjectOutOfBounds(physx::PxAggregate &aggregate);
+	};
+	physx::PxBroadPhaseType::Enum broadPhaseType;
+	physx::PxU32 broadPhaseSubdivisions;
+	physx::PxReal broadPhaseMargin;
+	bool broadPhaseLayoutPending;							// Statics were added since the automatic grid was last tried
+	BroadPhaseBoundsCallback broadPhaseCallback;
+	std::vector<physx::PxU32> broadPhaseRegions;			// Handles of the regions the engine added
+	physx::PxU32 layoutBroadPhaseRegions(const physx::PxBounds3 &bounds, physx::PxU32 subdivisions);
+	physx::PxBounds3 getStaticBounds();
+
+	// Simulation statistics
+	physx::PxSimulationStatistics simulationStats;		// Read once after each step
+	std::vector<StepStatistics> statistics;				// A ring of the most recent steps
+	size_t statisticsNext;								// Where the next step is recorded
+	size_t statisticsCount;
+	void recordStatistics(physx::PxReal period, physx::PxReal stepTime);
+
+	// Solver scratch memory (16 byte aligned, a multiple of 16 KB), grown between steps when the statistics call for more
+	void *scratchBlock;
+	physx::PxU32 scratchBlockSize;
+	void sizeScratchBlock();
+	std::vector<physx::PxActor*> queryActors;				// Reused by getActors, exportWorldMatrices and getQueryStructureStatistics
+
+	// Simulation level of detail
+	struct LodState
+	{
+		physx::PxU32 band;
+		physx::PxU32 positionIterations;	// The body's own settings, restored when it returns to a band that keeps them
+		physx::PxU32 velocityIterations;
+		physx::PxReal sleepThreshold;
+		bool frozen;
+		physx::PxVec3 linearVelocity;		// Held while frozen
+		physx::PxVec3 angularVelocity;
+	};
+	std::vector<SimulationLodBand> lodBands;
+	std::vector<physx::PxVec3> lodFocusPoints;
+	std::vector<physx::PxU32> lodPopulations;
+	std::unordered_map<physx::PxRigidDynamic*, LodState> lodStates;
+	physx::PxU32 lodInterval;
+	void updateLod();
+	void applyLodBand(physx::PxRigidDynamic *actor, LodState &state, physx::PxU32 band);
+	void restoreLod();
+	void restoreLodStates(const std::unordered_map<physx::PxRigidDynamic*, LodState> &states);
+
+	// Triple buffered snapshots, so the engine can publish while a consumer reads without sharing a lock
+	PhysicsSnapshot snapshots[3];
+	std::atomic_uint32_t snapshotState;			// Index of the most recently published snapshot, plus SNAPSHOT_FRESH if it hasn't been acquired
+	uint32_t snapshotWriteIndex;				// Only touched by the update thread
+	bool publishSnapshots;
+	uint32_t snapshotReadIndex;					// Only touched by the consumer
+	uint64_t stepCount;
+	std::vector<physx::PxActor*> publishActors;
+	std::vector<physx::PxShape*> publishShapes;
+	std::vector<physx::PxRigidActor*> publishedActors;	// The owner of each shape in the last published snapshot
+	std::vector<physx::PxTransform> publishedPoses;		// The pose of each shape in the last published snapshot
+
+	// Force fields, indexed in a grid of cells (fields covering too many cells are checked for every body instead)
+	physx::PxReal airDensity;
+	physx::PxReal forceFieldCellSize;
+	std::vector<ForceField> forceFields;
+	std::vector<physx::PxU32> forceFieldHandles;
+	physx::PxU32 nextForceFieldHandle;
+	bool forceFieldGridDirty;
+	std::unordered_map<uint64_t, std::vector<physx::PxU32>> forceFieldGrid;
+	std::vector<physx::PxU32> globalForceFields;
+	std::vector<physx::PxU32> forceFieldCandidates;
+	std::unordered_set<physx::PxRigidDynamic*> aeroLookup;
+	uint64_t forceFieldCell(const physx::PxVec3 &point) const;
+	void buildForceFieldGrid();
+	void gatherForceFields(const physx::PxVec3 &point);
+	physx::PxVec3 sampleAirVelocity(const physx::PxVec3 &point);
+	void applyForceFields();
+
+	// Debris, stored as a ring of parallel arrays (oldest at debrisTail)
+	physx::PxU32 debrisBudget;
+	physx::PxReal debrisLifetime;
+	physx::PxReal debrisRestitution;
+	physx::PxReal debrisFriction;
+	std::vector<physx::PxVec3> debrisPositions;
+	std::vector<physx::PxVec3> debrisPreviousPositions;
+	std::vector<physx::PxVec3> debrisVelocities;
+	std::vector<physx::PxReal> debrisRadii;
+	std::vector<physx::PxReal> debrisAges;
+	std::vector<uint8_t> debrisResting;
+	physx::PxU32 debrisTail;
+	physx::PxU32 debrisCount;
+	physx::PxBatchQuery *debrisQuery;
+	std::vector<physx::PxRaycastQueryResult> debrisResults;
+	std::vector<physx::PxU32> debrisQueried;			// The debris each raycast was made for
+	void updateDebris(physx::PxReal period);
+
+	// Checkpoints, each a set of parallel arrays (one entry per body) and per-actor maps reused from one checkpoint to the next
+	enum CheckpointFlags
+	{
+		CheckpointDynamic = 1,				// A PxRigidDynamic (the rest are articulation links)
+		CheckpointSleeping = 2,
+		CheckpointKinematicTarget = 4
+	};
+	struct Checkpoint
+	{
+		uint64_t step;
+		std::vector<physx::PxRigidBody*> bodies;
+		std::vector<physx::PxTransform> poses;
+		std::vector<physx::PxVec3> linearVelocities;
+		std::vector<physx::PxVec3> angularVelocities;
+		std::vector<physx::PxTransform> kinematicTargets;
+		std::vector<uint8_t> flags;
+		std::unordered_map<physx::PxRigidDynamic*, physx::PxVec3> aeroCoefficients;	// Lift, drag and surface area of each aerodynamic actor
+		std::unordered_map<physx::PxRigidDynamic*, double> kinematicTimes;			// Time along each kinematic motion
+		std::unordered_map<physx::PxRigidDynamic*, LodState> lodStates;
+	};
+	std::vector<Checkpoint> checkpoints;
+	size_t checkpointNext;
+	size_t checkpointCount;
+	std::unordered_set<physx::PxRigidBody*> liveBodies;		// The bodies still in the scene, checked on restore
+
+	// Kinematic motions
+	struct KinematicAnimation
+	{
+		physx::PxRigidDynamic *actor;
+		KinematicMotion motion;
+		physx::PxTransform startPose;
+		double time;							// Seconds since the motion was set
+	};
+	std::vector<KinematicAnimation> kinematicAnimations;
+	void updateKinematics(physx::PxReal period);
+	static physx::PxTransform evaluateMotion(const KinematicAnimation &animation);
+
+	// Static levels loaded in bulk. They are built off the update thread, then added (and their query tree built) at a step boundary
+	std::mutex levelMutex;								// Held through loadStaticLevel, so loads don't overlap
+	std::thread *levelLoader;
+	bool levelPending;									// A load has started and its level isn't merged yet
+	std::vector<physx::PxActor*> levelActors;			// Built by the loader, waiting to be merged
+	std::atomic<int> levelReady;
+	physx::PxU32 levelActorCount;
+	physx::PxReal levelBuildTime;
+	physx::PxReal levelMergeTime;
+	void joinLevelLoader();
+	void mergeStaticLevel();
+
+	// Character controllers (the manager is created with the first character)
+	physx::PxControllerManager *controllerManager;
+	physx::PxControllerFilters characterFilters;
+
+	// World matrix export
+	std::vector<physx::PxRigidDynamic*> exportActors;		// The awake actors being exported
+	std::vector<physx::PxU32> exportOffsets;				// Index of each exported actor's first matrix
+	std::vector<physx::PxShape*> exportShapes;				// Used when the caller doesn't ask for the shapes
+	float *exportMatrices;									// Where the export in progress writes
+	physx::PxShape **exportShapeOutput;
+
 	static void updateLoop(PhysicsEngine *pe);	// The static function that calls the update method at regular intervals
-	void update();
+	physx::PxReal update();						// Steps the simulation once, and returns the period that was simulated
+	std::vector<physx::PxArticulation*> publishArticulations;
+	std::vector<physx::PxArticulationLink*> publishLinks;
+	void publishSnapshot();
+	void publishActor(PhysicsSnapshot &snapshot, physx::PxRigidActor *actor);
+
+	physx::PxConvexMesh *cookConvexMesh(const physx::PxVec3 *pointCloud, physx::PxU32 numVertices, const ConvexCookingOptions &options);
+	physx::PxTriangleMesh *cookTriangleMesh(const physx::PxVec3 *vertices, physx::PxU32 numVertices, const void *indices, bool indices16Bit, physx::PxU32 numIndices, const TriangleMeshCookingOptions &options, TriangleMeshCookReport *report);
+	static void quantizePointCloud(const physx::PxVec3 *pointCloud, physx::PxU32 numVertices, physx::PxReal cellSize, std::vector<physx::PxVec3> &quantized);
 
 public:
 	// The materials currently allocated in the engine
@@ -62,8 +562,16 @@ public:
 		Wood, SolidPVC, HollowPVC, SolidSteel, HollowSteel, Concrete
 	};
 
+	// One single-shape static actor of a level loaded with loadStaticLevel
+	struct StaticLevelPiece
+	{
+		physx::PxTransform pose;
+		physx::PxGeometryHolder geometry;		// A copy, so the geometry it was made from needn't outlive the load
+		Material material;
+	};
+
 	// Constructor
-	PhysicsEngine();
+	PhysicsEngine(const PhysicsEngineDesc &desc = PhysicsEngineDesc());
 
 	// Returns a SphereGeometry object
 	physx::PxSphereGeometry createSphereGeometry(physx::PxReal radius);
@@ -72,10 +580,16 @@ public:
 	physx::PxCapsuleGeometry createCapsuleGeometry(physx::PxReal radius, physx::PxReal halfHeight);
 
 	// Returns a Cooked ConvexMesh Object
-	physx::PxConvexMesh *createConvexMesh(physx::PxVec3 *pointCloud, physx::PxU32 numVertices);
+	physx::PxConvexMesh *createConvexMesh(physx::PxVec3 *pointCloud, physx::PxU32 numVertices, const ConvexCookingOptions &options = ConvexCookingOptions());
+
+	// Returns a set of ConvexMesh Objects, one cooked with each set of options (order them from the most to the least detailed)
+	ConvexHullSet createConvexHullSet(physx::PxVec3 *pointCloud, physx::PxU32 numVertices, const ConvexCookingOptions *levels, physx::PxU32 numLevels);
 
 	// Returns a ConvexMeshGeometry object (calls createConvexMesh)
-	physx::PxConvexMeshGeometry createConvexMeshGeometry(physx::PxVec3 *pointCloud, physx::PxU32 numVertices);
+	physx::PxConvexMeshGeometry createConvexMeshGeometry(physx::PxVec3 *pointCloud, physx::PxU32 numVertices, const ConvexCookingOptions &options = ConvexCookingOptions());
+
+	// Returns a ConvexMeshGeometry object using one level of a hull set (clamped to the least detailed level available)
+	physx::PxConvexMeshGeometry createConvexMeshGeometry(const ConvexHullSet &hulls, physx::PxU32 level);
 
 	// Returns a ConvexMeshGeometry object (uses the ConvexMesh passed)
 	physx::PxConvexMeshGeometry createConvexMeshGeometry(physx::PxConvexMesh &mesh);
@@ -86,30 +600,187 @@ public:
 	// Returns a heightfield geometry
 	physx::PxHeightFieldGeometry createHeightFieldGeometry(physx::PxHeightField *heightField);
 
-	// Returns a triangle mesh
-	physx::PxTriangleMesh *createTriangleMesh(physx::PxVec3 *vertices, physx::PxU32 numVertices, physx::PxU32 *indices, physx::PxU32 numIndices);
+	// Returns a triangle mesh, or nullptr if the indices don't describe whole triangles within the vertex array. If report is given, it is filled in
+	physx::PxTriangleMesh *createTriangleMesh(physx::PxVec3 *vertices, physx::PxU32 numVertices, physx::PxU32 *indices, physx::PxU32 numIndices, const TriangleMeshCookingOptions &options = TriangleMeshCookingOptions(), TriangleMeshCookReport *report = nullptr);
+
+	// Returns a triangle mesh built from 16 bit indices
+	physx::PxTriangleMesh *createTriangleMesh(physx::PxVec3 *vertices, physx::PxU32 numVertices, physx::PxU16 *indices, physx::PxU32 numIndices, const TriangleMeshCookingOptions &options = TriangleMeshCookingOptions(), TriangleMeshCookReport *report = nullptr);
+
+	// Returns a triangle mesh cooked straight from an imported mesh (binary meshes are read from the mapped file without copying)
+	physx::PxTriangleMesh *createTriangleMesh(const ImportedMesh &mesh, const TriangleMeshCookingOptions &options = TriangleMeshCookingOptions(), TriangleMeshCookReport *report = nullptr);
 
 	// Returns a triangle mesh geometry (good for use as level geometry)
 	physx::PxTriangleMeshGeometry createTriangleMeshGeometry(physx::PxTriangleMesh* mesh);
 
-	// Adds a rigid dynamic actor to the scene, and returns a pointer reference to it
-	physx::PxRigidDynamic* addRigidDynamic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, physx::PxReal Mass, physx::PxVec3 MomentOfInertia, physx::PxVec3 initialLinearVelocity, physx::PxVec3 initialAngularVelocity, Material mat, physx::PxReal linearDamping = 0.0f, physx::PxReal angularDamping = 0.0f);
+	// Creates an empty aggregate in the scene for up to maxActors related actors (articulation links count individually). Actors added
+	// to the scene with it share one broadphase entry, and only collide with each other if selfCollision is set
+	physx::PxAggregate *createAggregate(physx::PxU32 maxActors, bool selfCollision);
+
+	// Adds a rigid dynamic actor to the scene (in the aggregate, if one is given), and returns a pointer reference to it
+	physx::PxRigidDynamic* addRigidDynamic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, physx::PxReal Mass, physx::PxVec3 MomentOfInertia, physx::PxVec3 initialLinearVelocity, physx::PxVec3 initialAngularVelocity, Material mat, physx::PxReal linearDamping = 0.0f, physx::PxReal angularDamping = 0.0f, physx::PxAggregate *aggregate = nullptr);
 
 	// Adds a rigid dynamic actor to the scene and applies aerodynamics to it at each update
-	physx::PxRigidDynamic *addRigidAerodynamic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, physx::PxReal Mass, physx::PxVec3 MomentOfInertia, physx::PxVec3 initialLinearVelocity, physx::PxVec3 initialAngularVelocity, Material mat, physx::PxReal linearDamping = 0.0f, physx::PxReal angularDamping = 0.0f, physx::PxReal lift = 0.0f, physx::PxReal drag = 0.0f, physx::PxReal planformArea = PI);
+	physx::PxRigidDynamic *addRigidAerodynamic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, physx::PxReal Mass, physx::PxVec3 MomentOfInertia, physx::PxVec3 initialLinearVelocity, physx::PxVec3 initialAngularVelocity, Material mat, physx::PxReal linearDamping = 0.0f, physx::PxReal angularDamping = 0.0f, physx::PxReal lift = 0.0f, physx::PxReal drag = 0.0f, physx::PxReal planformArea = PI, physx::PxAggregate *aggregate = nullptr);
 
 	// Adds a rigid static actor to the scene, and returns a pointer reference to it
-	physx::PxRigidStatic* addRigidStatic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, Material mat);
+	physx::PxRigidStatic* addRigidStatic(physx::PxVec3 position, physx::PxQuat orientation, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, Material mat, physx::PxAggregate *aggregate = nullptr);
+
+	// The kinds of joint that can connect two actors
+	enum JointType
+	{
+		FixedJoint, SphericalJoint, RevoluteJoint, D6Joint, DistanceJoint
+	};
+
+	// Connects two actors with a joint. Each frame is the joint's position and orientation relative to its actor (or relative to the
+	// world if the actor is nullptr). The joint can be configured further by casting it to the matching PhysX joint class
+	physx::PxJoint *createJoint(JointType type, physx::PxRigidActor *actor0, const physx::PxTransform &localFrame0, physx::PxRigidActor *actor1, const physx::PxTransform &localFrame1);
+
+	// Adds a chain of identical links to the scene as a single articulation, hanging along -y from anchorFrame (relative to anchor, or to the world if anchor is nullptr).
+	// Link i is centered (i + 0.5) * linkSpacing below the anchor point, and each joint allows the link below it to swing up to swingLimit radians.
+	// If alternate is set, every link is turned 90 degrees about the chain from the one above it (so interlocking links fit together)
+	physx::PxArticulation *addArticulatedChain(physx::PxRigidActor *anchor, physx::PxTransform anchorFrame, physx::PxU32 numLinks, physx::PxReal linkSpacing, physx::PxGeometry **components, physx::PxVec3 *componentLinearOffsets, physx::PxQuat *componentAngularOffsets, physx::PxU32 numComponents, physx::PxReal linkMass, physx::PxVec3 MomentOfInertia, Material mat, physx::PxReal swingLimit = PI / 4.0f, bool alternate = true, physx::PxAggregate *aggregate = nullptr);
 
 	// Sets the array of rigid actors to contain all of the actors in the scene
 	void getActors(std::vector<physx::PxRigidActor*> &actors);
 
+	// Returns the most recently published snapshot (does not lock the engine). Only one thread may consume snapshots,
+	// and the returned snapshot remains valid until the next call. Returns nullptr if no step has completed yet
+	const PhysicsSnapshot *acquireSnapshot();
+
+	// Records the state of every dynamic body (pose, velocities, sleep state, kinematic target, level of detail), every aerodynamic
+	// actor's coefficients and every kinematic motion's time into a ring of checkpoints, and returns the step it was taken at. The oldest checkpoint is overwritten when the ring is full
+	uint64_t checkpoint();
+
+	// Puts every body recorded at the given step back as it was, and returns false if there is no such checkpoint. Bodies added
+	// after the checkpoint are left alone
+	bool restore(uint64_t step);
+
+	// Simulates count steps immediately, without waiting for the wall clock (for resimulating after restore). The update thread's
+	// own steps still happen as usual
+	void step(physx::PxU32 count);
+
+	// Adds count pieces of debris of the given radius. If this goes over the budget, the oldest debris is removed
+	void spawnDebris(const physx::PxVec3 *positions, const physx::PxVec3 *velocities, physx::PxU32 count, physx::PxReal radius);
+
+	// Returns the number of pieces of debris
+	physx::PxU32 getDebrisCount();
+
+	// Adds a force field and returns its handle
+	physx::PxU32 addForceField(const ForceField &field);
+
+	// Removes a force field (explosions remove themselves after the step they are applied in)
+	void removeForceField(physx::PxU32 handle);
+
+	// Makes an actor kinematic and moves it along a motion, starting now from its current pose. The target is set inside every step,
+	// so the actor sweeps through contacts instead of being teleported
+	void setKinematicMotion(physx::PxRigidDynamic *actor, const KinematicMotion &motion);
+
+	// Stops moving an actor (it stays kinematic where it is)
+	void clearKinematicMotion(physx::PxRigidDynamic *actor);
+
+	// Adds an upright capsule character controller centred at position. The capsule comes from createCapsuleGeometry (its half
+	// height is half the distance between the sphere centres). Returns nullptr on failure
+	physx::PxController *addCharacter(const vec3 &position, const physx::PxCapsuleGeometry &capsule, Material material, physx::PxReal stepOffset = 0.3f, physx::PxReal slopeLimit = PI / 4.0f);
+
+	// Removes a character controller and its kinematic actor
+	void removeCharacter(physx::PxController *character);
+
+	// Moves count characters by their displacements, sliding along whatever they hit, all under a single lock. Call it once per
+	// tick for every agent rather than once per agent. If collisions is given, it receives the sides each character touched
+	void moveCharacters(physx::PxController *const *characters, const vec3 *displacements, physx::PxU32 count, physx::PxReal elapsedTime, physx::PxControllerCollisionFlags *collisions = nullptr);
+
+	// Writes the column-major world matrix of every shape of every awake dynamic actor (as of the last step) into matrices, which
+	// must be 16 byte aligned and have room for capacity matrices of 16 floats. If shapes is given, the shape each matrix belongs
+	// to is written to the same index. Returns the number of matrices needed; if that is more than capacity, nothing is written.
+	// The work is spread across the engine's worker threads
+	physx::PxU32 exportWorldMatrices(float *matrices, physx::PxU32 capacity, physx::PxShape **shapes = nullptr);
+
+	// Changes the friction and restitution of one of this engine's materials
+	void setMaterialProperties(Material mat, physx::PxReal staticFriction, physx::PxReal dynamicFriction, physx::PxReal restitution);
+
 	// Sets the gravitational force in the scene
 	void setGravity(vec3 gravity);
 
 	// Sets the frequency of the engine (in Hz)
 	void setFrequency(uint32_t frequency);
 
+	// Enables or disables the adaptive step rate governor (its bounds are set in PhysicsEngineDesc)
+	void setGovernorEnabled(bool enabled);
+
+	// Sets a function to be called with every decision the governor makes. It is called on the update thread with the
+	// engine locked, so it must not call back into the engine
+	void setGovernorCallback(std::function<void(const GovernorDecision&)> callback);
+
+	// Returns the governor's most recent decision
+	GovernorDecision getGovernorDecision();
+
+	// Sets the distance bands of the simulation level of detail system (sorted by maxDistance). Bodies beyond the last
+	// band use the last band. Bodies are re-evaluated every interval steps. Passing no bands disables the system and
+	// restores every body. While bands are set, bodies are no longer woken up every step
+	void setLodBands(const SimulationLodBand *bands, physx::PxU32 numBands, physx::PxU32 interval = 1);
+
+	// Sets the points (usually cameras or players) that bodies are kept at full detail around. With no focus points,
+	// every body is in the last band
+	void setLodFocusPoints(const physx::PxVec3 *points, physx::PxU32 numPoints);
+
+	// Fills populations with the number of dynamic bodies in each band at the last evaluation
+	void getLodPopulations(std::vector<physx::PxU32> &populations);
+
+	// Lays out a grid of subdivisions x subdivisions broadphase regions over the static actors in the scene (grown by the margin
+	// in PhysicsEngineDesc), replacing the regions added before. Returns the number of regions. Only used with the eMBP broadphase
+	physx::PxU32 setupBroadPhaseRegions(physx::PxU32 subdivisions);
+
+	// Lays out the grid over the given bounds instead (for levels that are streamed in)
+	physx::PxU32 setupBroadPhaseRegions(const physx::PxBounds3 &bounds, physx::PxU32 subdivisions);
+
+	// Adds a single broadphase region (such as a streamed terrain tile), and returns its handle (0xffffffff if it couldn't be added)
+	physx::PxU32 addBroadPhaseRegion(const physx::PxBounds3 &bounds);
+
+	// Removes a broadphase region added by addBroadPhaseRegion
+	void removeBroadPhaseRegion(physx::PxU32 handle);
+
+	// Builds a static actor for every piece and adds them to the scene together, building the static query tree in one go rather
+	// than over the steps that follow. In the background, the actors are built on a thread of their own and merged at the start of
+	// the first step after they are done; otherwise they are in the scene when this returns. With MBP, call setupBroadPhaseRegions
+	// once the level is in if the regions need to cover it
+	void loadStaticLevel(const std::vector<StaticLevelPiece> &pieces, bool background = true);
+
+	// Returns true while a level loaded in the background hasn't been merged yet
+	bool isLevelLoading();
+
+	// Sets the number of steps over which the dynamic query tree is rebuilt in the background (lower rebuilds sooner, at more cost per step)
+	void setDynamicTreeRebuildRateHint(physx::PxU32 hint);
+
+	// Returns the state of the scene query structures
+	QueryStructureStatistics getQueryStructureStatistics();
+
+	// Fills regions with the bounds of every broadphase region and the number of static and dynamic objects in it
+	void getBroadPhaseRegions(std::vector<physx::PxBroadPhaseRegionInfo> &regions);
+
+	// Fills actors with the actors that left every broadphase region during the last step (they don't collide until they return)
+	void getOutOfBoundsActors(std::vector<physx::PxActor*> &actors);
+
+	// Fills times with the CPU time (in seconds) used so far by each of the engine's threads: the update thread first, then each worker
+	void getThreadCpuTimes(std::vector<double> &times);
+
+	// Fills history with the recorded statistics of the most recent steps, oldest first
+	void getStatistics(std::vector<StepStatistics> &history);
+
+	// Writes the recorded statistics to a file as comma separated values, oldest first, with a header line
+	void dumpStatistics(FILE *file);
+
+	// Returns the number of allocations PhysX has made so far, across every engine in the process. Once the scene has
+	// warmed up, stepping it should leave this unchanged. Only PhysX's allocations are counted, not the engine's own: its
+	// per-step buffers keep their capacity between steps, so they only allocate while the scene grows
+	static uint64_t getAllocationCount();
+
+	// Enables or disables continuous collision detection for an actor (requires PhysicsEngineDesc::enableCCD)
+	void setCCD(physx::PxRigidDynamic *actor, bool enabled);
+
+	// Sets the distance at which contacts start being generated for every shape of an actor (speculative margin), and the
+	// distance at which its shapes come to rest. Larger contact offsets catch fast bodies earlier at the cost of more contacts
+	void setContactOffsets(physx::PxRigidActor *actor, physx::PxReal contactOffset, physx::PxReal restOffset = 0.0f);
+
 	// Returns the inertia tensor of an axis-aligned cube centered on the origin
 	static vec3 InertiaTensorSolidCube(physx::PxReal width, physx::PxReal mass);
 
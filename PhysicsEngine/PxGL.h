@@ -1,12 +1,19 @@
 #ifndef __PXGL_H__
 #define __PXGL_H__
 
+#ifdef _WIN32
 #include <glew/glew.h>
+#else
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/gl.h>
+#endif
 #include "types.h"
 #define radToDeg($1) ($1*57.295779513082320876798154814105f)
 #define degToRad($1) ($1/57.295779513082320876798154814105f)
 
-void glTransformPx(physx::PxTransform transform)
+static inline void glTransformPx(physx::PxTransform transform)
 {
 	glTranslatef(transform.p.x, transform.p.y, transform.p.z);
 	vec3 axis;
@@ -1,15 +1,40 @@
 #include "RenderEngine.h"
+#include "types.h"
+#ifdef _WIN32
 #include <glew/glew.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glext.h>
+#endif
+#include "PxGL.h"
+#include <algorithm>
 
 using namespace std;
 using namespace physx; 
 
 #pragma comment(lib, "glew32.lib")
 
-RenderEngine::RenderEngine(uint32_t width, uint32_t height, uint32_t MSAA, bool fullscreen) :
+RenderEngine::RenderEngine(PhysicsEngine *physics, uint32_t width, uint32_t height, uint32_t MSAA, bool fullscreen) :
 drawThread(nullptr),
 window(nullptr),
-updateFrequency(120)
+context(nullptr),
+width(width),
+height(height),
+physics(physics),
+updateFrequency(120),
+updatePeriod(1.0f / 120.0f),
+cameraYaw(0.0f),
+cameraPitch(0.0f),
+unitSphere(nullptr),
+unitHemisphere(nullptr),
+unitCylinder(nullptr),
+debrisSphere(nullptr),
+sphereBatch(nullptr),
+capsuleCapBatch(nullptr),
+capsuleBodyBatch(nullptr),
+debrisBatch(nullptr)
 {
 	if (SDL_Init(SDL_INIT_EVERYTHING) < 0)
 	{
@@ -35,12 +60,8 @@ updateFrequency(120)
 
 	context = SDL_GL_CreateContext(window);
 
-	if (SDL_GL_SetSwapInterval(-1) < 0)
-	{
-		printf("Late Frame Tearing not available\n");
-		SDL_GL_SetSwapInterval(1);
-	}
-	glewInit();
+	// The context is made current on the draw thread, which owns it from here on
+	SDL_GL_MakeCurrent(window, nullptr);
 
 	quit.store(0, memory_order_release);
 
@@ -51,13 +72,76 @@ void RenderEngine::threadFunc(RenderEngine *re)
 {
 	if (re == nullptr)
 		return;
+	SDL_GL_MakeCurrent(re->window, re->context);
+	if (SDL_GL_SetSwapInterval(-1) < 0)
+	{
+		printf("Late Frame Tearing not available\n");
+		SDL_GL_SetSwapInterval(1);
+	}
+#ifdef _WIN32
+	glewInit();
+#endif
+	re->LoadTexture();
+	re->InitGL();
+
 	while (!re->quit.load(memory_order_acquire))
 	{
 		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
 		re->Draw();
 		chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
-		this_thread::sleep_for(chrono::milliseconds(uint32_t(1000 * re->updatePeriod)) - (end - start));
+		unique_lock<mutex> lock(re->engineMutex);
+		chrono::microseconds period(uint32_t(1000000 * re->updatePeriod));
+		lock.unlock();
+		this_thread::sleep_for(period - chrono::duration_cast<chrono::microseconds>(end - start));
 	}
+
+	re->ReleaseGL();
+	SDL_GL_MakeCurrent(re->window, nullptr);
+}
+
+void RenderEngine::InitGL()
+{
+	float aspectRatio = float(width) / float(height);
+	frustumLeft = -1.0f;
+	frustumRight = 1.0f;
+	frustumBottom = -1.0f / aspectRatio;
+	frustumTop = 1.0f / aspectRatio;
+	frustumNear = 1.0f;
+	frustumFar = 1000.0f;
+	glClearColor(0.5, 0.5, 1.0, 1.0);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glFrustum(frustumLeft, frustumRight, frustumBottom, frustumTop, frustumNear, frustumFar);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LEQUAL);
+
+	// Unit primitives are built once and drawn as instanced batches scaled to each shape
+	unitSphere = RxMesh::createUnitSphere(32, 32);
+	unitHemisphere = RxMesh::createUnitHemisphere(32, 16);
+	unitCylinder = RxMesh::createUnitCylinder(32);
+	sphereBatch = new RxInstanceBatch(unitSphere, 1.0f, 0.5f, 0.0f);
+	capsuleCapBatch = new RxInstanceBatch(unitHemisphere, 0.5f, 0.0f, 1.0f);
+	capsuleBodyBatch = new RxInstanceBatch(unitCylinder, 0.5f, 0.0f, 1.0f);
+
+	// Debris is small and plentiful, so it gets a much coarser sphere
+	debrisSphere = RxMesh::createUnitSphere(8, 6);
+	debrisBatch = new RxInstanceBatch(debrisSphere, 0.6f, 0.6f, 0.6f);
+}
+
+void RenderEngine::ReleaseGL()
+{
+	delete debrisBatch;
+	delete debrisSphere;
+	delete capsuleBodyBatch;
+	delete capsuleCapBatch;
+	delete sphereBatch;
+	delete unitCylinder;
+	delete unitHemisphere;
+	delete unitSphere;
 }
 
 void RenderEngine::Draw()
@@ -65,14 +149,241 @@ void RenderEngine::Draw()
 	if (window)
 	{
 		unique_lock<mutex> lock(engineMutex);
+		float yaw = cameraYaw;
+		float pitch = cameraPitch;
+		lock.unlock();
+
 		// Clear Buffers
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// TODO: Draw Things
+		PxTransform camera = PxTransform(PxVec3(0.0f, 0.0f, -20.0f)) * PxTransform(PxQuat(degToRad(pitch), PxVec3(1.0f, 0.0f, 0.0f))) * PxTransform(PxQuat(degToRad(yaw), PxVec3(0.0f, 1.0f, 0.0f)));
+		PxMat44 view(camera);
+		glLoadMatrixf(view.front());
+
+		// Draw the latest published step, interpolated towards the wall clock. This never waits on the physics engine
+		const PhysicsSnapshot *snapshot = (physics != nullptr) ? physics->acquireSnapshot() : nullptr;
+		if (snapshot != nullptr)
+		{
+			PxReal alpha = snapshot->getAlpha(chrono::high_resolution_clock::now());
+
+			// Cull the actors' cached world bounds against the view frustum before submitting anything
+			PxMat44 projection(PxVec4(2.0f * frustumNear / (frustumRight - frustumLeft), 0.0f, 0.0f, 0.0f),
+				PxVec4(0.0f, 2.0f * frustumNear / (frustumTop - frustumBottom), 0.0f, 0.0f),
+				PxVec4((frustumRight + frustumLeft) / (frustumRight - frustumLeft), (frustumTop + frustumBottom) / (frustumTop - frustumBottom), -(frustumFar + frustumNear) / (frustumFar - frustumNear), -1.0f),
+				PxVec4(0.0f, 0.0f, -2.0f * frustumFar * frustumNear / (frustumFar - frustumNear), 0.0f));
+			RxFrustum frustum;
+			frustum.set(projection * view);
+
+			actorBounds.resize(snapshot->actors.size());
+			for (size_t i = 0; i < snapshot->actors.size(); i++)
+				actorBounds[i] = snapshot->actors[i].bounds;
+			if (cullingTree.size() != actorBounds.size())
+				cullingTree.build(actorBounds.data(), uint32_t(actorBounds.size()));
+			else
+				cullingTree.refit(actorBounds.data(), uint32_t(actorBounds.size()));
+			visibleActors.clear();
+			cullingTree.cull(frustum, visibleActors);
+
+			sphereBatch->clear();
+			capsuleCapBatch->clear();
+			capsuleBodyBatch->clear();
+			for (size_t i = 0; i < visibleActors.size(); i++)
+			{
+				const PhysicsSnapshot::Actor &actor = snapshot->actors[visibleActors[i]];
+				for (uint32_t j = actor.firstShape; j < actor.firstShape + actor.numShapes; j++)
+				{
+					const PhysicsSnapshot::Shape &shape = snapshot->shapes[j];
+					PxTransform pose = PhysicsSnapshot::interpolate(shape, alpha);
+					switch (shape.geometry.getType())
+					{
+					case PxGeometryType::eSPHERE:
+						sphereBatch->add(pose, PxVec3(shape.geometry.sphere().radius));
+						break;
+					case PxGeometryType::eCAPSULE:
+					{
+						const PxCapsuleGeometry &capsule = shape.geometry.capsule();
+						capsuleBodyBatch->add(pose, PxVec3(capsule.halfHeight, capsule.radius, capsule.radius));
+						capsuleCapBatch->add(pose * PxTransform(PxVec3(capsule.halfHeight, 0.0f, 0.0f)), PxVec3(capsule.radius));
+						capsuleCapBatch->add(pose * PxTransform(PxVec3(-capsule.halfHeight, 0.0f, 0.0f), PxQuat(PI, PxVec3(0.0f, 1.0f, 0.0f))), PxVec3(capsule.radius));
+						break;
+					}
+					case PxGeometryType::eCONVEX_MESH:
+						drawMesh(*shape.geometry.convexMesh().convexMesh, pose);
+						break;
+					case PxGeometryType::eTRIANGLEMESH:
+						drawMesh(*shape.geometry.triangleMesh().triangleMesh, pose);
+						break;
+					default:
+						break;
+					}
+				}
+			}
+			debrisBatch->clear();
+			for (size_t i = 0; i < snapshot->debris.size(); i++)
+			{
+				const PhysicsSnapshot::Debris &debris = snapshot->debris[i];
+				PxVec3 position = debris.previousPosition + (debris.position - debris.previousPosition) * alpha;
+				if (frustum.test(PxBounds3::centerExtents(position, PxVec3(debris.radius))) != RxFrustum::Outside)
+					debrisBatch->add(PxTransform(position), PxVec3(debris.radius));
+			}
+
+			sphereBatch->Draw();
+			capsuleCapBatch->Draw();
+			capsuleBodyBatch->Draw();
+			debrisBatch->Draw();
+		}
 
 		// Swap Buffers
 		SDL_GL_SwapWindow(window);
+		checkGLErrors();
+	}
+}
+
+void RenderEngine::drawMesh(const PxConvexMesh &mesh, const PxTransform &transform)
+{
+	glColor3f(0.25f, 1.0f, 0.5f);
+	glPushMatrix();
+
+	glTransformPx(transform);
+
+	// Draw the mesh here
+	PxU32 nbVerts = mesh.getNbVertices();
+	const PxVec3* convexVerts = mesh.getVertices();
+	const PxU8* indexBuffer = mesh.getIndexBuffer();
+
+	vector<vec3> vertices;
+
+	PxU32 offset = 0;
+	for (PxU32 i = 0; i<mesh.getNbPolygons(); i++)
+	{
+		PxHullPolygon face;
+		bool status = mesh.getPolygonData(i, face);
+		PX_ASSERT(status);
+
+		const PxU8* faceIndices = indexBuffer + face.mIndexBase;
+		for (PxU32 j = 0; j<face.mNbVerts; j++)
+		{
+			vertices.push_back(convexVerts[faceIndices[j]]);
+		}
+
+		glBegin(GL_TRIANGLES);
+		for (PxU32 j = 2; j<face.mNbVerts; j++)
+		{
+			
+			glTexCoord2f(0.0f, 1.0f); 
+			glVertex3f(vertices[offset].x, vertices[offset].y, vertices[offset].z);
+			glTexCoord2f(1.0f, 0.0f);
+			glVertex3f(vertices[offset+j].x, vertices[offset+j].y, vertices[offset+j].z);
+			glTexCoord2f(0.0f, 0.0f);
+			glVertex3f(vertices[offset+j-1].x, vertices[offset+j-1].y, vertices[offset+j-1].z);
+		}
+		glEnd();
+
+		offset += face.mNbVerts;
+	}
+
+	glPopMatrix();
+}
+
+void RenderEngine::drawMesh(const PxTriangleMesh &mesh, const PxTransform &transform)
+{
+	glColor3f(0.5f, 0.25f, 1.0f);
+	glPushMatrix();
+
+	glTransformPx(transform);
+
+	// Draw the mesh here
+	PxU32 numTriangles = mesh.getNbTriangles();
+	const PxVec3* vertices = mesh.getVertices();
+	if (mesh.getTriangleMeshFlags() & PxTriangleMeshFlag::eHAS_16BIT_TRIANGLE_INDICES)
+	{
+		PxU16* indices = (PxU16*)mesh.getTriangles();
+		glBegin(GL_TRIANGLES);
+		for (PxU32 i = 0; i < numTriangles; i++)
+		{
+			glTexCoord2f(0.0f, 1.0f);
+			glVertex3f(vertices[indices[3 * i]].x, vertices[indices[3 * i]].y, vertices[indices[3 * i]].z);
+			glTexCoord2f(1.0f, 0.0f);
+			glVertex3f(vertices[indices[3 * i+1]].x, vertices[indices[3 * i+1]].y, vertices[indices[3 * i+1]].z);
+			glTexCoord2f(0.0f, 0.0f);
+			glVertex3f(vertices[indices[3 * i+2]].x, vertices[indices[3 * i+2]].y, vertices[indices[3 * i+2]].z);
+		}
+		glEnd();
+	}
+	else
+	{
+		PxU32* indices = (PxU32*)mesh.getTriangles();
+		glBegin(GL_TRIANGLES);
+		for (PxU32 i = 0; i < numTriangles; i++)
+		{
+			glTexCoord2f(0.0f, 1.0f);
+			glVertex3f(vertices[indices[3 * i]].x, vertices[indices[3 * i]].y, vertices[indices[3 * i]].z);
+			glTexCoord2f(1.0f, 0.0f);
+			glVertex3f(vertices[indices[3 * i+1]].x, vertices[indices[3 * i+1]].y, vertices[indices[3 * i+1]].z);
+			glTexCoord2f(0.0f, 0.0f);
+			glVertex3f(vertices[indices[3 * i+2]].x, vertices[indices[3 * i+2]].y, vertices[indices[3 * i+2]].z);
+		}
+		glEnd();
 	}
+	glPopMatrix();
+}
+
+void RenderEngine::checkGLErrors()
+{
+	int glError = glGetError();
+	do
+	{
+		if (glError > 0)
+		{
+			printf("OpenGL Error: %s\n", gluErrorString(glError));
+			glError = glGetError();
+		}
+	} while (glError > 0);
+}
+
+void RenderEngine::LoadTexture()
+{
+	const unsigned char texturePixels[] = 
+	{	
+		0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 
+		255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 
+		0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 
+		255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0,
+		0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 
+		255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0,
+		0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 
+		255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0, 255, 255, 255, 0, 0, 0
+	};
+
+	GLuint textureHandle = 0;
+	glGenTextures(1, &textureHandle);
+	if (textureHandle == 0)
+	{
+		printf("Unable to generate Texture: %s\n", gluErrorString(glGetError()));
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D, textureHandle);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 8, 8, 0, GL_RGB, GL_UNSIGNED_BYTE, texturePixels);
+	glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+void RenderEngine::setCamera(float yaw, float pitch)
+{
+	unique_lock<mutex> lock(engineMutex);
+	cameraYaw = yaw;
+	cameraPitch = pitch;
+}
+
+void RenderEngine::setFrequency(uint32_t frequency)
+{
+	if (frequency == 0)
+		return;
+	unique_lock<mutex> lock(engineMutex);
+	updateFrequency = frequency;
+	updatePeriod = 1.0f / float(frequency);
 }
 
 RenderEngine::~RenderEngine()
@@ -81,9 +392,474 @@ RenderEngine::~RenderEngine()
 	{
 		quit.store(1, memory_order_release);
 		drawThread->join();
+		delete drawThread;
 	}
 
-	SDL_GL_DeleteContext(context);
-	SDL_DestroyWindow(window);
+	// Either may be missing if construction failed part way
+	if (context != nullptr)
+		SDL_GL_DeleteContext(context);
+	if (window != nullptr)
+		SDL_DestroyWindow(window);
 	SDL_Quit();
-}
\ No newline at end of file
+}
+
+#pragma region Meshes
+RxMesh::RxMesh(const vector<float> &vertices, const vector<uint32_t> &indices) :
+references(1),
+vertexBuffer(0),
+indexBuffer(0),
+indexCount(uint32_t(indices.size()))
+{
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+uint32_t RxMesh::getVertexBuffer() const
+{
+	return vertexBuffer;
+}
+
+uint32_t RxMesh::getIndexBuffer() const
+{
+	return indexBuffer;
+}
+
+uint32_t RxMesh::getIndexCount() const
+{
+	return indexCount;
+}
+
+void RxMesh::Draw() const
+{
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 5 * sizeof(float), (void*)0);
+	glTexCoordPointer(2, GL_FLOAT, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+	glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void*)0);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Builds a latitude/longitude grid around the x axis, from the pole at +x down to the polar angle maxTheta
+RxMesh *RxMesh::createSphericalCap(uint32_t slices, uint32_t stacks, float maxTheta)
+{
+	vector<float> vertices;
+	vector<uint32_t> indices;
+	vertices.reserve((slices + 1) * (stacks + 1) * 5);
+	indices.reserve(slices * stacks * 6);
+	for (uint32_t i = 0; i <= stacks; i++)
+	{
+		float theta = maxTheta * float(i) / float(stacks);
+		for (uint32_t j = 0; j <= slices; j++)
+		{
+			float phi = 2.0f * PI * float(j) / float(slices);
+			vertices.push_back(cosf(theta));
+			vertices.push_back(sinf(theta) * cosf(phi));
+			vertices.push_back(sinf(theta) * sinf(phi));
+			vertices.push_back(float(j) / float(slices));
+			vertices.push_back(float(i) / float(stacks));
+		}
+	}
+	for (uint32_t i = 0; i < stacks; i++)
+	{
+		for (uint32_t j = 0; j < slices; j++)
+		{
+			uint32_t a = i * (slices + 1) + j;
+			uint32_t b = a + slices + 1;
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(a + 1);
+			indices.push_back(a + 1);
+			indices.push_back(b);
+			indices.push_back(b + 1);
+		}
+	}
+	return new RxMesh(vertices, indices);
+}
+
+RxMesh *RxMesh::createUnitSphere(uint32_t slices, uint32_t stacks)
+{
+	return createSphericalCap(slices, stacks, PI);
+}
+
+RxMesh *RxMesh::createUnitHemisphere(uint32_t slices, uint32_t stacks)
+{
+	return createSphericalCap(slices, stacks, 0.5f * PI);
+}
+
+RxMesh *RxMesh::createUnitCylinder(uint32_t slices)
+{
+	vector<float> vertices;
+	vector<uint32_t> indices;
+	vertices.reserve((slices + 1) * 2 * 5);
+	indices.reserve(slices * 6);
+	for (uint32_t j = 0; j <= slices; j++)
+	{
+		float phi = 2.0f * PI * float(j) / float(slices);
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			vertices.push_back((i == 0) ? -1.0f : 1.0f);
+			vertices.push_back(cosf(phi));
+			vertices.push_back(sinf(phi));
+			vertices.push_back(float(j) / float(slices));
+			vertices.push_back(float(i));
+		}
+	}
+	for (uint32_t j = 0; j < slices; j++)
+	{
+		uint32_t a = 2 * j;
+		indices.push_back(a);
+		indices.push_back(a + 1);
+		indices.push_back(a + 2);
+		indices.push_back(a + 2);
+		indices.push_back(a + 1);
+		indices.push_back(a + 3);
+	}
+	return new RxMesh(vertices, indices);
+}
+
+RxMesh::~RxMesh()
+{
+	glDeleteBuffers(1, &indexBuffer);
+	glDeleteBuffers(1, &vertexBuffer);
+}
+#pragma endregion
+
+#pragma region Instancing
+// Attribute locations shared by the instancing shader and RxInstanceBatch::Draw
+#define RX_ATTRIB_POSITION 0
+#define RX_ATTRIB_TEXCOORD 1
+#define RX_ATTRIB_INSTANCE 2	// Occupies 4 locations, one per matrix column
+
+static const char *instanceVertexShader =
+	"#version 130\n"
+	"in vec3 position;\n"
+	"in vec2 texCoord;\n"
+	"in vec4 instance0;\n"
+	"in vec4 instance1;\n"
+	"in vec4 instance2;\n"
+	"in vec4 instance3;\n"
+	"out vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"	mat4 world = mat4(instance0, instance1, instance2, instance3);\n"
+	"	uv = texCoord;\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * world * vec4(position, 1.0);\n"
+	"}\n";
+
+static const char *instanceFragmentShader =
+	"#version 130\n"
+	"uniform sampler2D diffuse;\n"
+	"uniform vec3 color;\n"
+	"in vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_FragColor = vec4(color, 1.0) * texture(diffuse, uv);\n"
+	"}\n";
+
+static GLuint compileShader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, nullptr);
+	glCompileShader(shader);
+	GLint status = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+		printf("Shader Compile Error: %s\n", log);
+	}
+	return shader;
+}
+
+uint32_t RxInstanceBatch::getProgram()
+{
+	static GLuint program = 0;
+	if (program == 0)
+	{
+		GLuint vs = compileShader(GL_VERTEX_SHADER, instanceVertexShader);
+		GLuint fs = compileShader(GL_FRAGMENT_SHADER, instanceFragmentShader);
+		program = glCreateProgram();
+		glAttachShader(program, vs);
+		glAttachShader(program, fs);
+		glBindAttribLocation(program, RX_ATTRIB_POSITION, "position");
+		glBindAttribLocation(program, RX_ATTRIB_TEXCOORD, "texCoord");
+		glBindAttribLocation(program, RX_ATTRIB_INSTANCE + 0, "instance0");
+		glBindAttribLocation(program, RX_ATTRIB_INSTANCE + 1, "instance1");
+		glBindAttribLocation(program, RX_ATTRIB_INSTANCE + 2, "instance2");
+		glBindAttribLocation(program, RX_ATTRIB_INSTANCE + 3, "instance3");
+		glLinkProgram(program);
+		GLint status = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+		if (status != GL_TRUE)
+		{
+			char log[1024];
+			glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+			printf("Shader Link Error: %s\n", log);
+		}
+		glDeleteShader(vs);
+		glDeleteShader(fs);
+	}
+	return program;
+}
+
+RxInstanceBatch::RxInstanceBatch(const RxMesh *mesh, float r, float g, float b) :
+mesh(mesh),
+instanceBuffer(0),
+instanceCapacity(0)
+{
+	color[0] = r;
+	color[1] = g;
+	color[2] = b;
+	glGenBuffers(1, &instanceBuffer);
+}
+
+void RxInstanceBatch::clear()
+{
+	instances.clear();
+}
+
+void RxInstanceBatch::add(const PxTransform &pose, const PxVec3 &scale)
+{
+	PxMat44 world(pose);
+	world.column0 *= scale.x;
+	world.column1 *= scale.y;
+	world.column2 *= scale.z;
+	instances.push_back(world);
+}
+
+uint32_t RxInstanceBatch::size() const
+{
+	return uint32_t(instances.size());
+}
+
+void RxInstanceBatch::Draw()
+{
+	if (mesh == nullptr || instances.empty())
+		return;
+
+	GLuint program = getProgram();
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "diffuse"), 0);
+	glUniform3fv(glGetUniformLocation(program, "color"), 1, color);
+
+	// Grow the instance buffer geometrically, and orphan it every frame so the driver doesn't stall on the previous frame
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	if (instances.size() > instanceCapacity)
+		instanceCapacity = uint32_t(instances.size()) * 2;
+	glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(PxMat44), nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(PxMat44), instances.data());
+	for (GLuint i = 0; i < 4; i++)
+	{
+		glEnableVertexAttribArray(RX_ATTRIB_INSTANCE + i);
+		glVertexAttribPointer(RX_ATTRIB_INSTANCE + i, 4, GL_FLOAT, GL_FALSE, sizeof(PxMat44), (void*)(i * 4 * sizeof(float)));
+		glVertexAttribDivisor(RX_ATTRIB_INSTANCE + i, 1);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->getVertexBuffer());
+	glEnableVertexAttribArray(RX_ATTRIB_POSITION);
+	glEnableVertexAttribArray(RX_ATTRIB_TEXCOORD);
+	glVertexAttribPointer(RX_ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+	glVertexAttribPointer(RX_ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->getIndexBuffer());
+	glDrawElementsInstanced(GL_TRIANGLES, mesh->getIndexCount(), GL_UNSIGNED_INT, (void*)0, GLsizei(instances.size()));
+
+	for (GLuint i = 0; i < 4; i++)
+	{
+		glVertexAttribDivisor(RX_ATTRIB_INSTANCE + i, 0);
+		glDisableVertexAttribArray(RX_ATTRIB_INSTANCE + i);
+	}
+	glDisableVertexAttribArray(RX_ATTRIB_TEXCOORD);
+	glDisableVertexAttribArray(RX_ATTRIB_POSITION);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+}
+
+RxInstanceBatch::~RxInstanceBatch()
+{
+	glDeleteBuffers(1, &instanceBuffer);
+}
+#pragma endregion
+
+#pragma region Culling
+void RxFrustum::set(const PxMat44 &m)
+{
+	// Gribb/Hartmann plane extraction: each plane is the last row of the matrix plus or minus one of the others
+	PxVec4 row0(m(0, 0), m(0, 1), m(0, 2), m(0, 3));
+	PxVec4 row1(m(1, 0), m(1, 1), m(1, 2), m(1, 3));
+	PxVec4 row2(m(2, 0), m(2, 1), m(2, 2), m(2, 3));
+	PxVec4 row3(m(3, 0), m(3, 1), m(3, 2), m(3, 3));
+	planes[0] = row3 + row0;	// Left
+	planes[1] = row3 - row0;	// Right
+	planes[2] = row3 + row1;	// Bottom
+	planes[3] = row3 - row1;	// Top
+	planes[4] = row3 + row2;	// Near
+	planes[5] = row3 - row2;	// Far
+	for (uint32_t i = 0; i < 6; i++)
+		planes[i] *= 1.0f / planes[i].getXYZ().magnitude();
+}
+
+RxFrustum::Result RxFrustum::test(const PxBounds3 &bounds) const
+{
+	Result result = Inside;
+	for (uint32_t i = 0; i < 6; i++)
+	{
+		const PxVec4 &plane = planes[i];
+		// The corners of the box furthest along and against the plane's normal
+		PxVec3 positive((plane.x >= 0.0f) ? bounds.maximum.x : bounds.minimum.x, (plane.y >= 0.0f) ? bounds.maximum.y : bounds.minimum.y, (plane.z >= 0.0f) ? bounds.maximum.z : bounds.minimum.z);
+		PxVec3 negative((plane.x >= 0.0f) ? bounds.minimum.x : bounds.maximum.x, (plane.y >= 0.0f) ? bounds.minimum.y : bounds.maximum.y, (plane.z >= 0.0f) ? bounds.minimum.z : bounds.maximum.z);
+		if (plane.getXYZ().dot(positive) + plane.w < 0.0f)
+			return Outside;
+		if (plane.getXYZ().dot(negative) + plane.w < 0.0f)
+			result = Intersecting;
+	}
+	return result;
+}
+
+void RxBoundsTree::build(const PxBounds3 *bounds, uint32_t count)
+{
+	nodes.clear();
+	leaves.resize(count);
+	items.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+		items[i] = i;
+	if (count > 0)
+	{
+		nodes.reserve(2 * count - 1);
+		build(bounds, 0, count, -1);
+	}
+}
+
+int32_t RxBoundsTree::build(const PxBounds3 *bounds, uint32_t first, uint32_t count, int32_t parent)
+{
+	// Nodes are stored in pre-order, so a parent always comes before its children
+	int32_t index = int32_t(nodes.size());
+	nodes.push_back(Node());
+	nodes[index].parent = parent;
+	if (count == 1)
+	{
+		nodes[index].bounds = bounds[items[first]];
+		nodes[index].left = -1;
+		nodes[index].right = -1;
+		nodes[index].item = int32_t(items[first]);
+		leaves[items[first]] = index;
+		return index;
+	}
+
+	// Split at the median centroid along the longest axis of the centroids' extent
+	PxBounds3 centroids = PxBounds3::empty();
+	for (uint32_t i = first; i < first + count; i++)
+		centroids.include(bounds[items[i]].getCenter());
+	PxVec3 extents = centroids.getExtents();
+	uint32_t axis = (extents.x > extents.y) ? ((extents.x > extents.z) ? 0 : 2) : ((extents.y > extents.z) ? 1 : 2);
+	uint32_t half = count / 2;
+	nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count, [bounds, axis](uint32_t a, uint32_t b)
+	{
+		return bounds[a].getCenter()[axis] < bounds[b].getCenter()[axis];
+	});
+
+	int32_t left = build(bounds, first, half, index);
+	int32_t right = build(bounds, first + half, count - half, index);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	nodes[index].item = -1;
+	nodes[index].bounds = nodes[left].bounds;
+	nodes[index].bounds.include(nodes[right].bounds);
+	return index;
+}
+
+void RxBoundsTree::refit(const PxBounds3 *bounds, uint32_t count)
+{
+	if (count != leaves.size())
+	{
+		build(bounds, count);
+		return;
+	}
+
+	dirty.assign(nodes.size(), 0);
+	bool changed = false;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		Node &leaf = nodes[leaves[i]];
+		if (leaf.bounds.minimum == bounds[i].minimum && leaf.bounds.maximum == bounds[i].maximum)
+			continue;
+		leaf.bounds = bounds[i];
+		changed = true;
+		for (int32_t node = leaf.parent; node >= 0 && !dirty[node]; node = nodes[node].parent)
+			dirty[node] = 1;
+	}
+	if (!changed)
+		return;
+
+	// Children always have higher indices than their parents, so walking backwards refits bottom-up
+	for (int32_t i = int32_t(nodes.size()) - 1; i >= 0; i--)
+	{
+		if (dirty[i])
+		{
+			nodes[i].bounds = nodes[nodes[i].left].bounds;
+			nodes[i].bounds.include(nodes[nodes[i].right].bounds);
+		}
+	}
+}
+
+uint32_t RxBoundsTree::size() const
+{
+	return uint32_t(leaves.size());
+}
+
+void RxBoundsTree::collect(int32_t node, vector<uint32_t> &visible) const
+{
+	if (nodes[node].item >= 0)
+	{
+		visible.push_back(uint32_t(nodes[node].item));
+		return;
+	}
+	collect(nodes[node].left, visible);
+	collect(nodes[node].right, visible);
+}
+
+void RxBoundsTree::cull(const RxFrustum &frustum, vector<uint32_t> &visible)
+{
+	if (nodes.empty())
+		return;
+	stack.clear();
+	stack.push_back(0);
+	while (!stack.empty())
+	{
+		int32_t node = stack.back();
+		stack.pop_back();
+		switch (frustum.test(nodes[node].bounds))
+		{
+		case RxFrustum::Outside:
+			break;
+		case RxFrustum::Inside:
+			// Everything below a fully contained node is visible without further tests
+			collect(node, visible);
+			break;
+		case RxFrustum::Intersecting:
+			if (nodes[node].item >= 0)
+				visible.push_back(uint32_t(nodes[node].item));
+			else
+			{
+				stack.push_back(nodes[node].right);
+				stack.push_back(nodes[node].left);
+			}
+			break;
+		}
+	}
+}
+#pragma endregion
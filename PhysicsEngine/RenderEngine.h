@@ -5,23 +5,126 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <vector>
 #include <SDL/SDL.h>
 #include <PxPhysicsAPI.h>
+#include "PhysicsEngine.h"
 
 class RxMesh;
 class RxActor;
 class RxTexture;
+class RxInstanceBatch;
 
+// A static, indexed triangle mesh stored in GPU buffers (interleaved position and texture coordinates)
 class RxMesh
 {
 private:
 	uint32_t references;
 	uint32_t vertexBuffer;
 	uint32_t indexBuffer;
+	uint32_t indexCount;
+
+	RxMesh(const std::vector<float> &vertices, const std::vector<uint32_t> &indices);
+	static RxMesh *createSphericalCap(uint32_t slices, uint32_t stacks, float maxTheta);
 public:
 	uint32_t getVertexBuffer() const;
 	uint32_t getIndexBuffer() const;
+	uint32_t getIndexCount() const;
 	void Draw() const;
+
+	// Returns a sphere of radius 1 centered on the origin
+	static RxMesh *createUnitSphere(uint32_t slices, uint32_t stacks);
+
+	// Returns a hemisphere of radius 1 centered on the origin, bulging towards +x
+	static RxMesh *createUnitHemisphere(uint32_t slices, uint32_t stacks);
+
+	// Returns an open cylinder of radius 1 aligned with the x axis, spanning x = -1 to x = 1
+	static RxMesh *createUnitCylinder(uint32_t slices);
+
+	~RxMesh();
+};
+
+// Draws every instance of a mesh in a single draw call, using a per-instance world matrix (which includes scale)
+class RxInstanceBatch
+{
+private:
+	const RxMesh *mesh;
+	uint32_t instanceBuffer;
+	uint32_t instanceCapacity;
+	std::vector<physx::PxMat44> instances;
+	float color[3];
+
+	static uint32_t getProgram();
+public:
+	RxInstanceBatch(const RxMesh *mesh, float r, float g, float b);
+
+	// Removes all instances from the batch (call once per frame)
+	void clear();
+
+	// Adds an instance of the mesh at the given world pose, scaled along each of the mesh's local axes
+	void add(const physx::PxTransform &pose, const physx::PxVec3 &scale);
+
+	// Returns the number of instances in the batch
+	uint32_t size() const;
+
+	// Uploads the instance buffer and draws all of the instances
+	void Draw();
+
+	~RxInstanceBatch();
+};
+
+// The six planes of a view frustum in world space, with normals pointing inwards
+class RxFrustum
+{
+private:
+	physx::PxVec4 planes[6];
+public:
+	enum Result
+	{
+		Outside, Intersecting, Inside
+	};
+
+	// Extracts the planes from a combined projection * view matrix
+	void set(const physx::PxMat44 &viewProjection);
+
+	// Classifies an axis-aligned box against the frustum
+	Result test(const physx::PxBounds3 &bounds) const;
+};
+
+// A bounding volume hierarchy over a set of actor bounds. Built once when the set of actors changes, and refit
+// incrementally (only changed leaves and their ancestors) as the actors move
+class RxBoundsTree
+{
+private:
+	struct Node
+	{
+		physx::PxBounds3 bounds;
+		int32_t parent;
+		int32_t left;
+		int32_t right;
+		int32_t item;				// The index of the leaf's actor, or -1 for internal nodes
+	};
+
+	std::vector<Node> nodes;
+	std::vector<int32_t> leaves;	// The node holding each item
+	std::vector<uint32_t> items;	// Scratch space used while building
+	std::vector<int32_t> stack;		// Scratch space used while culling
+	std::vector<uint8_t> dirty;		// Scratch space used while refitting
+
+	int32_t build(const physx::PxBounds3 *bounds, uint32_t first, uint32_t count, int32_t parent);
+	void collect(int32_t node, std::vector<uint32_t> &visible) const;
+public:
+	// Rebuilds the tree from scratch
+	void build(const physx::PxBounds3 *bounds, uint32_t count);
+
+	// Updates the bounds of every item, growing the tree's volumes only along the paths whose leaves changed
+	void refit(const physx::PxBounds3 *bounds, uint32_t count);
+
+	// Returns the number of items in the tree
+	uint32_t size() const;
+
+	// Appends the index of every item whose bounds intersect the frustum
+	void cull(const RxFrustum &frustum, std::vector<uint32_t> &visible);
 };
 
 class RxActor
@@ -43,14 +146,52 @@ private:
 	std::atomic_int quit;
 	SDL_Window *window;
 	SDL_GLContext context;
+	uint32_t width;
+	uint32_t height;
+
+	// The engine whose published snapshots are drawn (never locked by the renderer)
+	PhysicsEngine *physics;
+
+	uint32_t updateFrequency;					// DEFAULT: 120 Hz
+	float updatePeriod;							// DEFAULT: 1/120 s
 
-	uint32_t updateFrequency;
-	float updatePeriod;
+	float cameraYaw;
+	float cameraPitch;
+
+	// The parameters passed to glFrustum, kept so the same frustum can be used for culling
+	float frustumLeft, frustumRight, frustumBottom, frustumTop, frustumNear, frustumFar;
+
+	// Culling state, only touched by the draw thread
+	RxBoundsTree cullingTree;
+	std::vector<physx::PxBounds3> actorBounds;
+	std::vector<uint32_t> visibleActors;
+
+	// Unit primitives and the batches that draw them, created on the draw thread
+	RxMesh *unitSphere;
+	RxMesh *unitHemisphere;
+	RxMesh *unitCylinder;
+	RxMesh *debrisSphere;
+	RxInstanceBatch *sphereBatch;
+	RxInstanceBatch *capsuleCapBatch;
+	RxInstanceBatch *capsuleBodyBatch;
+	RxInstanceBatch *debrisBatch;
 
 	static void threadFunc(RenderEngine *re);
+	void InitGL();
+	void LoadTexture();
 	void Draw();
+	void ReleaseGL();
+	static void drawMesh(const physx::PxConvexMesh &mesh, const physx::PxTransform &transform);
+	static void drawMesh(const physx::PxTriangleMesh &mesh, const physx::PxTransform &transform);
+	static void checkGLErrors();
 public:
-	RenderEngine(uint32_t width, uint32_t height, uint32_t MSAA = 16, bool fullscreen = true);
+	RenderEngine(PhysicsEngine *physics, uint32_t width, uint32_t height, uint32_t MSAA = 16, bool fullscreen = true);
+
+	// Sets the orientation of the camera (in degrees)
+	void setCamera(float yaw, float pitch);
+
+	// Sets the frequency at which frames are drawn (in Hz), independent of the physics engine's frequency
+	void setFrequency(uint32_t frequency);
 
 	~RenderEngine();
 };